@@ -21,7 +21,11 @@
 #ifndef ETH_TRAJECTORY_GENERATION_EXTREMUM_H_
 #define ETH_TRAJECTORY_GENERATION_EXTREMUM_H_
 
+#include <array>
 #include <iostream>
+#include <vector>
+
+#include <eth_trajectory_generation/motion_defines.h>
 
 namespace eth_trajectory_generation
 {
@@ -54,6 +58,36 @@ inline std::ostream& operator<<(std::ostream& stream, const Extremum& e) {
   return stream;
 }
 
+// Highest derivative for which the maxima of the magnitude are stored per
+// derivative.
+static constexpr int kMaxMagnitudeDerivative = derivative_order::SNAP;
+
+// Maxima of the magnitude indexed by the derivative. Derivatives whose
+// maximum was not computed have segment_idx == -1.
+struct MagnitudeMaxima
+{
+public:
+  MagnitudeMaxima() {
+    extrema.fill(Extremum(0.0, 0.0, -1));
+  }
+
+  bool isSet(int derivative) const {
+    return extrema[derivative].segment_idx >= 0;
+  }
+
+  Extremum& operator[](int derivative) {
+    return extrema[derivative];
+  }
+  const Extremum& operator[](int derivative) const {
+    return extrema[derivative];
+  }
+
+  std::array<Extremum, kMaxMagnitudeDerivative + 1> extrema;
+};
+
+// All candidates of the maxima of the magnitude indexed by the derivative.
+typedef std::array<std::vector<Extremum>, kMaxMagnitudeDerivative + 1> MagnitudeCandidates;
+
 }  // namespace eth_trajectory_generation
 
 #endif  // ETH_TRAJECTORY_GENERATION_EXTREMUM_H_
@@ -23,8 +23,9 @@
 
 #include <eth_trajectory_generation/misc.h>
 #include <Eigen/Sparse>
-#include <set>
+#include <array>
 #include <tuple>
+#include <unordered_set>
 
 // fixes error due to std::iota (has been introduced in c++ standard lately
 // and may cause compilation errors depending on compiler)
@@ -35,6 +36,8 @@
 #endif
 
 #include <eth_trajectory_generation/convolution.h>
+#include <eth_trajectory_generation/rpoly/rpoly_ak1.h>
+#include <eth_trajectory_generation/thread_pool.h>
 
 namespace eth_trajectory_generation
 {
@@ -49,9 +52,12 @@ PolynomialOptimization<_N>::PolynomialOptimization(size_t dimension)
       n_segments_(0),
       n_all_constraints_(0),
       n_fixed_constraints_(0),
-      n_free_constraints_(0) {
-  fixed_constraints_compact_.resize(dimension_);
-  free_constraints_compact_.resize(dimension_);
+      n_free_constraints_(0),
+      dense_solver_threshold_(kDefaultDenseSolverThreshold),
+      rpp_decomposition_valid_(false),
+      parallel_segment_threshold_(ThreadPool::kDefaultParallelSegmentThreshold) {
+  fixed_constraints_compact_.resize(0, dimension_);
+  free_constraints_compact_.resize(0, dimension_);
 }
 
 //}
@@ -100,6 +106,8 @@ bool PolynomialOptimization<_N>::setupFromVertices(const Vertex::Vector& vertice
       vertex = vertex_tmp;
     }
   }
+  corridor_weights_.assign(n_segments_, 0.0);
+
   updateSegmentTimes(times);
   setupConstraintReorderingMatrix();
   return true;
@@ -122,20 +130,132 @@ void PolynomialOptimization<_N>::setupMappingMatrix(double segment_time, SquareM
 
 //}
 
+/* computeSegmentMatrices() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::computeSegmentMatrices(int derivative, double segment_time, SquareMatrix* inverse_mapping_matrix, SquareMatrix* cost_matrix) {
+  CHECK(derivative >= 0 && derivative < N);
+
+  // The matrices of the unit segment, computed on the first call.
+  static const SquareMatrix unit_inverse_mapping_matrix = []() {
+    SquareMatrix A, A_inv;
+    setupMappingMatrix(1.0, &A);
+    invertMappingMatrix(A, &A_inv);
+    return A_inv;
+  }();
+
+  static const std::array<SquareMatrix, N> unit_cost_matrices = []() {
+    std::array<SquareMatrix, N> Q;
+    for (int r = 0; r < N; ++r) {
+      computeQuadraticCostJacobian(r, 1.0, &Q[r]);
+    }
+    return Q;
+  }();
+
+  // Powers of the segment time, T^j and T^-j.
+  const double                inverse_time = 1.0 / segment_time;
+  Eigen::Matrix<double, N, 1> powers, inverse_powers;
+  powers(0)         = 1.0;
+  inverse_powers(0) = 1.0;
+  for (int j = 1; j < N; ++j) {
+    powers(j)         = powers(j - 1) * segment_time;
+    inverse_powers(j) = inverse_powers(j - 1) * inverse_time;
+  }
+
+  Eigen::Matrix<double, N, 1> derivative_scaling;
+  derivative_scaling << powers.template head<N / 2>(), powers.template head<N / 2>();
+  *inverse_mapping_matrix = inverse_powers.asDiagonal() * unit_inverse_mapping_matrix * derivative_scaling.asDiagonal();
+
+  // The rows and columns below the derivative are zero, T^(1-2r) is split
+  // as T * T^-r * T^-r into the scaling of the non-zero ones.
+  Eigen::Matrix<double, N, 1> cost_scaling = Eigen::Matrix<double, N, 1>::Zero();
+  cost_scaling.tail(N - derivative)         = powers.head(N - derivative);
+  *cost_matrix                              = segment_time * cost_scaling.asDiagonal() * unit_cost_matrices[derivative] * cost_scaling.asDiagonal();
+}
+
+//}
+
+/* computeCorridorCostMatrix() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::computeCorridorCostMatrix(double segment_time, SquareMatrix* corridor_cost_matrix) {
+  CHECK_NOTNULL(corridor_cost_matrix);
+
+  // The matrix of the unit segment, computed on the first call. The
+  // deviation of the unit segment is sum_j c_j * (s^j - p(s)), p being the
+  // profile along the line, the constant coefficient does not contribute.
+  static const SquareMatrix unit_corridor_cost_matrix = []() {
+    const int       n_coefficients = std::max(static_cast<int>(N), 6);
+    Eigen::MatrixXd deviation_basis(n_coefficients, N);
+    for (int j = 0; j < N; ++j) {
+      deviation_basis.col(j).setZero();
+      if (j == 0) {
+        continue;
+      }
+      deviation_basis(j, j) += 1.0;
+      deviation_basis(3, j) -= 10.0;
+      deviation_basis(4, j) += 15.0;
+      deviation_basis(5, j) -= 6.0;
+    }
+
+    // Twice the integral of the products over [0, 1], as the cost matrix.
+    SquareMatrix W;
+    for (int j = 0; j < N; ++j) {
+      for (int k = 0; k < N; ++k) {
+        double integral = 0.0;
+        for (int a = 0; a < n_coefficients; ++a) {
+          for (int b = 0; b < n_coefficients; ++b) {
+            integral += deviation_basis(a, j) * deviation_basis(b, k) / (a + b + 1);
+          }
+        }
+        W(j, k) = 2.0 * integral;
+      }
+    }
+    return W;
+  }();
+
+  Eigen::Matrix<double, N, 1> powers;
+  powers(0) = 1.0;
+  for (int j = 1; j < N; ++j) {
+    powers(j) = powers(j - 1) * segment_time;
+  }
+
+  *corridor_cost_matrix = segment_time * powers.asDiagonal() * unit_corridor_cost_matrix * powers.asDiagonal();
+}
+
+//}
+
+/* computeWeightedSegmentMatrices() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::computeWeightedSegmentMatrices(size_t segment, double segment_time, SquareMatrix* inverse_mapping_matrix,
+                                                                SquareMatrix* cost_matrix) const {
+  computeSegmentMatrices(derivative_to_optimize_, segment_time, inverse_mapping_matrix, cost_matrix);
+
+  if (corridor_weights_[segment] > 0.0) {
+    SquareMatrix corridor_cost_matrix;
+    computeCorridorCostMatrix(segment_time, &corridor_cost_matrix);
+    *cost_matrix += corridor_weights_[segment] * corridor_cost_matrix;
+  }
+}
+
+//}
+
 /* computeCost() //{ */
 
 template <int _N>
 double PolynomialOptimization<_N>::computeCost() const {
   CHECK(n_segments_ == segments_.size() && n_segments_ == cost_matrices_.size());
-  double cost = 0;
+  double                                       cost = 0;
+  Eigen::Matrix<double, N, Eigen::Dynamic> coefficients(N, dimension_);
   for (size_t segment_idx = 0; segment_idx < n_segments_; ++segment_idx) {
     const SquareMatrix& Q       = cost_matrices_[segment_idx];
     const Segment&      segment = segments_[segment_idx];
     for (size_t dimension_idx = 0; dimension_idx < dimension_; ++dimension_idx) {
-      const Eigen::VectorXd c            = segment[dimension_idx].getCoefficients(derivative_order::POSITION);
-      const double          partial_cost = c.transpose() * Q * c;
-      cost += partial_cost;
+      coefficients.col(dimension_idx) = segment[dimension_idx].getCoefficients(derivative_order::POSITION);
     }
+    // Sum of c^T * Q * c over all dimensions (columns of the coefficients).
+    cost += (Q * coefficients).cwiseProduct(coefficients).sum();
   }
   return 0.5 * cost;  // cost = 0.5 * c^T * Q * c
 }
@@ -187,73 +307,76 @@ void PolynomialOptimization<_N>::setupConstraintReorderingMatrix() {
 
   const size_t n_vertices = vertices_.size();
 
-  std::vector<Constraint> all_constraints;
-  std::set<Constraint>    fixed_constraints;
-  std::set<Constraint>    free_constraints;
+  // Assign the compact column of every (vertex, derivative) pair directly.
+  // Fixed constraints are ordered by vertex and derivative, followed by the
+  // free constraints in the same order. Each pair occupies a single column,
+  // which is shared by both occurrences at the inner vertices to enforce
+  // continuity. This replaces the lookup of every constraint in sorted sets of
+  // fixed and free constraints, which was quadratic in the number of vertices.
+  n_fixed_constraints_ = 0;
+  for (size_t vertex_idx = 0; vertex_idx < n_vertices; ++vertex_idx) {
+    for (size_t constraint_idx = 0; constraint_idx < N / 2; ++constraint_idx) {
+      if (vertices_[vertex_idx].hasConstraint(constraint_idx)) {
+        ++n_fixed_constraints_;
+      }
+    }
+  }
+  n_free_constraints_ = n_vertices * N / 2 - n_fixed_constraints_;
 
-  all_constraints.reserve(n_vertices_ * N / 2);  // Will have exactly this number of elements in the end.
+  std::vector<int>& compact_col = compact_columns_;
+  compact_col.resize(n_vertices * N / 2);
+  rpp_decomposition_valid_ = false;
 
+  int fixed_col = 0;
+  int free_col  = n_fixed_constraints_;
   for (size_t vertex_idx = 0; vertex_idx < n_vertices; ++vertex_idx) {
-    const Vertex& vertex = vertices_[vertex_idx];
+    for (size_t constraint_idx = 0; constraint_idx < N / 2; ++constraint_idx) {
+      if (vertices_[vertex_idx].hasConstraint(constraint_idx)) {
+        compact_col[vertex_idx * N / 2 + constraint_idx] = fixed_col++;
+      } else {
+        compact_col[vertex_idx * N / 2 + constraint_idx] = free_col++;
+      }
+    }
+  }
+
+  // For the start and end Vertex, the constraints appear once, while they
+  // appear twice for the other vertices (end of one segment, start of the
+  // next one).
+  n_all_constraints_ = n_segments_ * N;
+
+  reordering_list.reserve(n_all_constraints_);
+  constraint_reordering_ = Eigen::SparseMatrix<double>(n_all_constraints_, n_fixed_constraints_ + n_free_constraints_);
 
-    // Extract constraints and sort them to fixed and free. For the start and
-    // end Vertex, we need to do this once, while we need to do it twice for the
-    // other vertices, since constraints are shared and enforce continuity.
+  int row = 0;
+  for (size_t vertex_idx = 0; vertex_idx < n_vertices; ++vertex_idx) {
     int n_constraint_occurence = 2;
     if (vertex_idx == 0 || vertex_idx == (n_segments_))
       n_constraint_occurence = 1;
     for (int co = 0; co < n_constraint_occurence; ++co) {
       for (size_t constraint_idx = 0; constraint_idx < N / 2; ++constraint_idx) {
-        Constraint constraint;
-        constraint.vertex_idx     = vertex_idx;
-        constraint.constraint_idx = constraint_idx;
-        bool has_constraint       = vertex.getConstraint(constraint_idx, &(constraint.value));
-        if (has_constraint) {
-          all_constraints.push_back(constraint);
-          fixed_constraints.insert(constraint);
-        } else {
-          constraint.value = Vertex::ConstraintValue::Constant(dimension_, 0);
-          all_constraints.push_back(constraint);
-          free_constraints.insert(constraint);
-        }
+        reordering_list.emplace_back(Triplet(row, compact_col[vertex_idx * N / 2 + constraint_idx], 1.0));
+        ++row;
       }
     }
   }
 
-  n_all_constraints_   = all_constraints.size();
-  n_fixed_constraints_ = fixed_constraints.size();
-  n_free_constraints_  = free_constraints.size();
-
-  reordering_list.reserve(n_all_constraints_);
-  constraint_reordering_ = Eigen::SparseMatrix<double>(n_all_constraints_, n_fixed_constraints_ + n_free_constraints_);
+  constraint_reordering_.setFromTriplets(reordering_list.begin(), reordering_list.end());
 
-  for (Eigen::VectorXd& df : fixed_constraints_compact_)
-    df.resize(n_fixed_constraints_, Eigen::NoChange);
+  // Fill in the values of the fixed constraints.
+  fixed_constraints_compact_.resize(n_fixed_constraints_, dimension_);
+  free_constraints_compact_.setZero(n_free_constraints_, dimension_);
 
-  int row = 0;
-  int col = 0;
-  for (const Constraint& ca : all_constraints) {
-    for (const Constraint& cf : fixed_constraints) {
-      if (ca == cf) {
-        reordering_list.emplace_back(Triplet(row, col, 1.0));
+  Vertex::ConstraintValue value;
+  for (size_t vertex_idx = 0; vertex_idx < n_vertices; ++vertex_idx) {
+    for (size_t constraint_idx = 0; constraint_idx < N / 2; ++constraint_idx) {
+      if (vertices_[vertex_idx].getConstraint(constraint_idx, &value)) {
+        const int col = compact_col[vertex_idx * N / 2 + constraint_idx];
         for (size_t d = 0; d < dimension_; ++d) {
-          Eigen::VectorXd&      df                        = fixed_constraints_compact_[d];
-          const Eigen::VectorXd constraint_all_dimensions = cf.value;
-          df[col]                                         = constraint_all_dimensions[d];
+          fixed_constraints_compact_(col, d) = value[d];
         }
       }
-      ++col;
     }
-    for (const Constraint& cp : free_constraints) {
-      if (ca == cp)
-        reordering_list.emplace_back(Triplet(row, col, 1.0));
-      ++col;
-    }
-    col = 0;
-    ++row;
   }
-
-  constraint_reordering_.setFromTriplets(reordering_list.begin(), reordering_list.end());
 }
 
 //}
@@ -264,19 +387,18 @@ template <int _N>
 void PolynomialOptimization<_N>::updateSegmentsFromCompactConstraints() {
   const size_t n_all_constraints = n_fixed_constraints_ + n_free_constraints_;
 
-  for (size_t dimension_idx = 0; dimension_idx < dimension_; ++dimension_idx) {
-    const Eigen::VectorXd& df     = fixed_constraints_compact_[dimension_idx];
-    const Eigen::VectorXd& dp_opt = free_constraints_compact_[dimension_idx];
+  Eigen::MatrixXd d_all(n_all_constraints, dimension_);
+  d_all << fixed_constraints_compact_, free_constraints_compact_;
 
-    Eigen::VectorXd d_all(n_all_constraints);
-    d_all << df, dp_opt;
+  // Reorder the constraints of all segments and dimensions at once.
+  const Eigen::MatrixXd d_reordered = constraint_reordering_ * d_all;
 
-    for (size_t i = 0; i < n_segments_; ++i) {
-      const Eigen::Matrix<double, N, 1> new_d   = constraint_reordering_.block(i * N, 0, N, n_all_constraints) * d_all;
-      const Eigen::Matrix<double, N, 1> coeffs  = inverse_mapping_matrices_[i] * new_d;
-      Segment&                          segment = segments_[i];
-      segment.setTime(segment_times_[i]);
-      segment[dimension_idx] = Polynomial(N, coeffs);
+  for (size_t i = 0; i < n_segments_; ++i) {
+    const Eigen::Matrix<double, N, Eigen::Dynamic> coeffs  = inverse_mapping_matrices_[i] * d_reordered.middleRows<N>(i * N);
+    Segment&                                       segment = segments_[i];
+    segment.setTime(segment_times_[i]);
+    for (size_t dimension_idx = 0; dimension_idx < dimension_; ++dimension_idx) {
+      segment[dimension_idx] = Polynomial(N, coeffs.col(dimension_idx));
     }
   }
 }
@@ -290,21 +412,65 @@ void PolynomialOptimization<_N>::updateSegmentTimes(const std::vector<double>& s
   const size_t n_segment_times = segment_times.size();
   CHECK(n_segment_times == n_segments_) << "Number of segment times (" << n_segment_times << ") does not match number of segments (" << n_segments_ << ")";
 
-  segment_times_ = segment_times;
+  segment_times_           = segment_times;
+  rpp_decomposition_valid_ = false;
 
   for (size_t i = 0; i < n_segments_; i++) {
     const double segment_time = segment_times[i];
     CHECK_GT(segment_time, 0) << "Segment times need to be greater than zero";
 
-    computeQuadraticCostJacobian(derivative_to_optimize_, segment_time, &cost_matrices_[i]);
-    SquareMatrix A;
-    setupMappingMatrix(segment_time, &A);
-    invertMappingMatrix(A, &inverse_mapping_matrices_[i]);
+    computeWeightedSegmentMatrices(i, segment_time, &inverse_mapping_matrices_[i], &cost_matrices_[i]);
   };
 }
 
 //}
 
+/* setCorridorWeights() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::setCorridorWeights(const std::vector<double>& corridor_weights) {
+  CHECK_EQ(corridor_weights.size(), n_segments_);
+
+  corridor_weights_ = corridor_weights;
+
+  // The cost matrices are computed again.
+  updateSegmentTimes(segment_times_);
+}
+
+//}
+
+/* updateStartVertex() //{ */
+
+template <int _N>
+bool PolynomialOptimization<_N>::updateStartVertex(const Vertex& vertex) {
+  CHECK_EQ(static_cast<size_t>(vertex.D()), dimension_);
+  CHECK(!vertices_.empty());
+
+  for (int constraint_idx = 0; constraint_idx < N / 2; ++constraint_idx) {
+    if (vertex.hasConstraint(constraint_idx) != vertices_.front().hasConstraint(constraint_idx)) {
+      return false;
+    }
+  }
+
+  // The fixed constraints are ordered by vertex and derivative, the ones of
+  // the start vertex come first.
+  Vertex                  vertex_valid(dimension_);
+  Vertex::ConstraintValue value;
+  int                     col = 0;
+  for (int constraint_idx = 0; constraint_idx < N / 2; ++constraint_idx) {
+    if (vertex.getConstraint(constraint_idx, &value)) {
+      vertex_valid.addConstraint(constraint_idx, value);
+      fixed_constraints_compact_.row(col++) = value.transpose();
+    }
+  }
+
+  vertices_.front()        = vertex_valid;
+  rpp_decomposition_valid_ = false;
+  return true;
+}
+
+//}
+
 /* constructR() //{ */
 
 template <int _N>
@@ -345,12 +511,10 @@ bool PolynomialOptimization<_N>::solveLinear() {
     DLOG(WARNING) << "No free constraints set in the vertices. Polynomial can "
                      "not be optimized. Outputting fully constrained polynomial.";
     updateSegmentsFromCompactConstraints();
+    rpp_decomposition_valid_ = true;
     return true;
   }
 
-  // TODO(acmarkus): figure out if sparse becomes less efficient for small
-  // problems, and switch back to dense in case.
-
   // Compute cost matrix for the unconstrained optimization problem.
   // Block-wise H = A^{-T}QA^{-1} according to [1]
   Eigen::SparseMatrix<double> R;
@@ -359,13 +523,33 @@ bool PolynomialOptimization<_N>::solveLinear() {
   // Extract block matrices and prepare solver.
   Eigen::SparseMatrix<double> Rpf = R.block(n_fixed_constraints_, 0, n_free_constraints_, n_fixed_constraints_);
   Eigen::SparseMatrix<double> Rpp = R.block(n_fixed_constraints_, n_fixed_constraints_, n_free_constraints_, n_free_constraints_);
-  Eigen::SparseQR<Eigen::SparseMatrix<double>, Eigen::COLAMDOrdering<int>> solver;
-  solver.compute(Rpp);
 
-  // Compute dp_opt for every dimension.
-  for (size_t dimension_idx = 0; dimension_idx < dimension_; ++dimension_idx) {
-    Eigen::VectorXd df                       = -Rpf * fixed_constraints_compact_[dimension_idx];  // Rpf = Rfp^T
-    free_constraints_compact_[dimension_idx] = solver.solve(df);                                  // dp = -Rpp^-1 * Rpf * df
+  // Right-hand sides of all dimensions, dp = -Rpp^-1 * Rpf * df.
+  const Eigen::MatrixXd df = -Rpf * fixed_constraints_compact_;  // Rpf = Rfp^T
+
+  // Rpp is symmetric, positive definite. For small problems, the overhead of
+  // the sparse LDLT (symbolic analysis, sparse storage) dominates, so Rpp is
+  // decomposed densely instead.
+  // The decomposition is kept for computeCostChangeOfSegmentTime().
+  rpp_decomposition_valid_ = true;
+  rpp_sparse_solver_.reset();
+
+  if (n_free_constraints_ <= dense_solver_threshold_) {
+    rpp_dense_solver_.compute(Eigen::MatrixXd(Rpp));
+    free_constraints_compact_ = rpp_dense_solver_.solve(df);
+  } else {
+    // The QR with a COLAMD ordering filled in up to ten times as many
+    // non-zeros as the banded LDLT, e.g. for N = 8.
+    std::shared_ptr<SparseSolver> solver = std::make_shared<SparseSolver>(Rpp);
+    if (solver->info() == Eigen::Success) {
+      free_constraints_compact_ = solver->solve(df);
+      rpp_sparse_solver_        = solver;
+    } else {
+      Eigen::SparseQR<Eigen::SparseMatrix<double>, Eigen::COLAMDOrdering<int>> solver_qr;
+      solver_qr.compute(Rpp);
+      free_constraints_compact_ = solver_qr.solve(df);
+      rpp_decomposition_valid_  = false;
+    }
   }
 
   updateSegmentsFromCompactConstraints();
@@ -374,6 +558,92 @@ bool PolynomialOptimization<_N>::solveLinear() {
 
 //}
 
+/* computeCostChangeOfSegmentTime() //{ */
+
+template <int _N>
+bool PolynomialOptimization<_N>::computeCostChangeOfSegmentTime(size_t segment, double segment_time, double* cost_change) const {
+  CHECK_NOTNULL(cost_change);
+  CHECK_LT(segment, n_segments_);
+  CHECK_GT(segment_time, 0) << "Segment times need to be greater than zero";
+
+  if (!rpp_decomposition_valid_) {
+    return false;
+  }
+
+  // Change of the block of R of the segment, in its own constraints.
+  SquareMatrix inverse_mapping_matrix, cost_matrix;
+  computeWeightedSegmentMatrices(segment, segment_time, &inverse_mapping_matrix, &cost_matrix);
+
+  const SquareMatrix& A_inv = inverse_mapping_matrices_[segment];
+  const SquareMatrix  dR =
+      inverse_mapping_matrix.transpose() * cost_matrix * inverse_mapping_matrix - A_inv.transpose() * cost_matrices_[segment] * A_inv;
+
+  // Values of the constraints of the segment, the free ones are updated
+  // below. I and F are the local indices of the free and the fixed
+  // constraints, U selects I from all free constraints.
+  SegmentMatrix    d(N, dimension_);
+  std::vector<int> free_local, free_compact, fixed_local;
+  for (int l = 0; l < N; ++l) {
+    const int col = compact_columns_[segment * N / 2 + l];
+    if (col < static_cast<int>(n_fixed_constraints_)) {
+      d.row(l) = fixed_constraints_compact_.row(col);
+      fixed_local.push_back(l);
+    } else {
+      d.row(l) = free_constraints_compact_.row(col - n_fixed_constraints_);
+      free_local.push_back(l);
+      free_compact.push_back(col - n_fixed_constraints_);
+    }
+  }
+
+  const int k = free_local.size();
+
+  if (k > 0) {
+    // With C = dR_II, the right-hand side changes by U * g, g = -dR_IF * d_F.
+    Eigen::MatrixXd C(k, k), g = Eigen::MatrixXd::Zero(k, dimension_), x_I(k, dimension_);
+    for (int i = 0; i < k; ++i) {
+      for (int j = 0; j < k; ++j) {
+        C(i, j) = dR(free_local[i], free_local[j]);
+      }
+      for (const int l : fixed_local) {
+        g.row(i) -= dR(free_local[i], l) * d.row(l);
+      }
+      x_I.row(i) = d.row(free_local[i]);
+    }
+
+    // W = U^T * Rpp^-1 * U, the columns of the inverse of the free
+    // constraints of the segment.
+    Eigen::MatrixXd U = Eigen::MatrixXd::Zero(n_free_constraints_, k);
+    for (int i = 0; i < k; ++i) {
+      U(free_compact[i], i) = 1.0;
+    }
+    const Eigen::MatrixXd Z = rpp_sparse_solver_ ? Eigen::MatrixXd(rpp_sparse_solver_->solve(U)) : Eigen::MatrixXd(rpp_dense_solver_.solve(U));
+    Eigen::MatrixXd       W(k, k);
+    for (int i = 0; i < k; ++i) {
+      W.row(i) = Z.row(free_compact[i]);
+    }
+
+    // Woodbury: (Rpp + U C U^T)^-1 = Rpp^-1 - Z (I + C W)^-1 C Z^T, the
+    // solution changes by Z * h.
+    const Eigen::MatrixXd h = g - (Eigen::MatrixXd::Identity(k, k) + C * W).partialPivLu().solve(C * (x_I + W * g));
+
+    const Eigen::MatrixXd x_I_new = x_I + W * h;
+    for (int i = 0; i < k; ++i) {
+      d.row(free_local[i]) = x_I_new.row(i);
+    }
+
+    // The old solution is optimal, its cost grows by 0.5 * (Z h)^T Rpp (Z h)
+    // = 0.5 * h^T W h.
+    *cost_change = 0.5 * (h.transpose() * W * h).trace();
+  } else {
+    *cost_change = 0.0;
+  }
+
+  *cost_change += 0.5 * (d.transpose() * dR * d).trace();
+  return true;
+}
+
+//}
+
 /* printReorderingMatrix() //{ */
 
 template <int _N>
@@ -495,6 +765,231 @@ Extremum PolynomialOptimization<_N>::computeMaximumOfMagnitude(int derivative, s
 
 //}
 
+/* computeMaximaOfMagnitude() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::computeMaximaOfMagnitude(const std::vector<int>& requested_derivatives, MagnitudeMaxima* maxima,
+                                                          MagnitudeCandidates* candidates) const {
+  CHECK_NOTNULL(maxima);
+  CHECK(!segments_.empty());
+
+  *maxima = MagnitudeMaxima();
+  if (candidates != nullptr) {
+    for (std::vector<Extremum>& c : *candidates)
+      c.clear();
+  }
+
+  // Several constraints may share a derivative.
+  std::vector<int> derivatives;
+  int              highest_derivative = 0;
+  for (int derivative : requested_derivatives) {
+    CHECK_GE(derivative, 0);
+    CHECK_LE(derivative, kMaxMagnitudeDerivative);
+    CHECK(N - derivative - 1 > 0) << "N-Derivative-1 has to be greater 0";
+    if (maxima->isSet(derivative))
+      continue;
+    derivatives.push_back(derivative);
+    highest_derivative    = std::max(highest_derivative, derivative);
+    (*maxima)[derivative] = Extremum();
+  }
+  if (derivatives.empty())
+    return;
+
+  // Entries are referenced until the end, so the cache is only cleared here.
+  if (extrema_cache_.size() + n_segments_ > kExtremaCacheMaxSize)
+    extrema_cache_.clear();
+
+  // Look up the segments serially, unchanged segments reuse their
+  // candidates. Changed coefficients hash to another entry or replace a
+  // colliding one, unless the colliding one is used by another segment of
+  // this call, which then keeps it and the segment gets a private entry.
+  // Equal segments share an entry, which is searched once.
+  std::vector<ExtremaCacheEntry*>              entries(n_segments_);
+  std::vector<ExtremaCacheEntry*>              entries_to_search;
+  std::unordered_set<const ExtremaCacheEntry*> used_entries;
+  std::vector<ExtremaCacheEntry>               private_entries;
+  private_entries.reserve(n_segments_);  // Keeps the pointers valid.
+  SegmentMatrix coefficients(N, dimension_);
+  for (size_t segment_idx = 0; segment_idx < n_segments_; ++segment_idx) {
+    const Segment& segment      = segments_[segment_idx];
+    const double   segment_time = segment.getTime();
+
+    for (size_t d = 0; d < dimension_; ++d) {
+      coefficients.col(d) = segment[d].getCoefficients(0);
+    }
+
+    ExtremaCacheEntry* entry = &extrema_cache_[hashSegment(coefficients, segment_time)];
+    if (entry->segment_time != segment_time || entry->coefficients.cols() != coefficients.cols() || entry->coefficients != coefficients) {
+      if (used_entries.count(entry) > 0) {
+        private_entries.emplace_back();
+        entry = &private_entries.back();
+      }
+      entry->coefficients = coefficients;
+      entry->segment_time = segment_time;
+      for (std::vector<Extremum>& c : entry->candidates)
+        c.clear();
+    }
+    entries[segment_idx] = entry;
+    used_entries.insert(entry);
+
+    bool search = false;
+    for (int derivative : derivatives) {
+      search |= entry->candidates[derivative].empty();
+    }
+    if (search && std::find(entries_to_search.begin(), entries_to_search.end(), entry) == entries_to_search.end()) {
+      entries_to_search.push_back(entry);
+      for (int derivative : derivatives) {
+        if (entry->candidates[derivative].empty())
+          ++extrema_cache_statistics_.misses;
+        else
+          ++extrema_cache_statistics_.hits;
+      }
+    } else {
+      extrema_cache_statistics_.hits += derivatives.size();
+    }
+  }
+
+  // The searches of the segments are independent, each thread has its own
+  // scratch.
+  ThreadPool&                 pool = ThreadPool::getGlobalPool();
+  std::vector<ExtremaScratch> scratch(pool.getNumberOfThreads());
+  pool.parallelFor(entries_to_search.size(), parallel_segment_threshold_, [&](size_t i, size_t thread_idx) {
+    computeSegmentMaximaCandidates(derivatives, highest_derivative, entries_to_search[i], &scratch[thread_idx]);
+  });
+
+  // Reduce serially in the order of the segments, which keeps the result
+  // independent of the number of threads.
+  for (size_t segment_idx = 0; segment_idx < n_segments_; ++segment_idx) {
+    for (int derivative : derivatives) {
+      Extremum& maximum = (*maxima)[derivative];
+      for (const Extremum& c : entries[segment_idx]->candidates[derivative]) {
+        const Extremum candidate(c.time, c.value, segment_idx);
+        if (maximum < candidate)
+          maximum = candidate;
+        if (candidates != nullptr)
+          (*candidates)[derivative].emplace_back(candidate);
+      }
+    }
+  }
+
+  // Check last time at last segment, the second candidate of every segment.
+  for (int derivative : derivatives) {
+    const Extremum& end = entries.back()->candidates[derivative][1];
+    const Extremum  candidate(end.time, end.value, n_segments_ - 1);
+    Extremum&       maximum = (*maxima)[derivative];
+    if (maximum < candidate)
+      maximum = candidate;
+    if (candidates != nullptr)
+      (*candidates)[derivative].emplace_back(candidate);
+  }
+}
+
+//}
+
+/* computeSegmentMaximaCandidates() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::computeSegmentMaximaCandidates(const std::vector<int>& derivatives, int highest_derivative, ExtremaCacheEntry* entry,
+                                                                ExtremaScratch* scratch) {
+  const SegmentMatrix& coefficients = entry->coefficients;
+  const int            dimension    = coefficients.cols();
+
+  // Coefficients of the derivatives 0 .. highest_derivative + 1 of all
+  // dimensions, column derivative * dimension + d. The derivative + 1
+  // needed for the extrema of one derivative is the derivative of the next
+  // one, so each is computed once.
+  Eigen::MatrixXd& derivative_coefficients = scratch->derivative_coefficients;
+  derivative_coefficients.resize(N, (highest_derivative + 2) * dimension);
+  for (int d = 0; d < dimension; ++d) {
+    for (int k = 0; k <= highest_derivative + 1; ++k) {
+      auto column = derivative_coefficients.col(k * dimension + d);
+      column.head(N - k) = coefficients.col(d).tail(N - k).cwiseProduct(Polynomial::base_coefficients_.block(k, k, 1, N - k).transpose());
+      column.tail(k).setZero();
+    }
+  }
+
+  // Magnitude of the derivative at time t, Horner's scheme on the
+  // coefficients above.
+  auto evaluateMagnitude = [&](int derivative, double t) {
+    double magnitude_squared = 0.0;
+    for (int d = 0; d < dimension; ++d) {
+      const auto c     = derivative_coefficients.col(derivative * dimension + d);
+      double     value = 0.0;
+      for (int i = N - derivative - 1; i >= 0; --i)
+        value = value * t + c[i];
+      magnitude_squared += value * value;
+    }
+    return std::sqrt(magnitude_squared);
+  };
+
+  scratch->convolved.resize(highest_derivative + 1);
+  for (int derivative : derivatives) {
+    std::vector<Extremum>& segment_candidates = entry->candidates[derivative];
+    if (!segment_candidates.empty())
+      continue;
+
+    const int n_d  = N - derivative;
+    const int n_dd = n_d - 1;
+
+    // The extrema of the magnitude are at the roots of the derivative of the
+    // squared magnitude, the sum of the convolutions of each dimension with
+    // its derivative. A single dimension needs no convolution.
+    bool success;
+    if (dimension > 1) {
+      Eigen::VectorXd& c = scratch->convolved[derivative];
+      c.setZero(Polynomial::getConvolutionLength(n_d, n_dd));
+      for (int d = 0; d < dimension; ++d) {
+        const auto p  = derivative_coefficients.col(derivative * dimension + d);
+        const auto dp = derivative_coefficients.col((derivative + 1) * dimension + d);
+        for (int i = 0; i < n_d; ++i)
+          for (int j = 0; j < n_dd; ++j)
+            c[i + j] += p[i] * dp[j];
+      }
+      success = findRootsJenkinsTraub(c, &scratch->roots);
+    } else {
+      success = findRootsJenkinsTraub(derivative_coefficients.col(derivative + 1).head(n_dd), &scratch->roots);
+    }
+    if (!success)
+      scratch->roots.resize(0);
+
+    // The candidates always start with 0 and the segment time.
+    Polynomial::selectMinMaxCandidatesFromRoots(0.0, entry->segment_time, scratch->roots, &scratch->extrema_times);
+    for (double t : scratch->extrema_times) {
+      segment_candidates.emplace_back(t, evaluateMagnitude(derivative, t), 0);
+    }
+  }
+}
+
+//}
+
+/* hashSegment() //{ */
+
+template <int _N>
+size_t PolynomialOptimization<_N>::hashSegment(const SegmentMatrix& coefficients, double segment_time) {
+  std::hash<double> hasher;
+  size_t            seed = hasher(segment_time);
+  for (int i = 0; i < coefficients.size(); ++i) {
+    seed ^= hasher(coefficients.data()[i]) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+  }
+  return seed;
+}
+
+//}
+
+/* setFreeConstraints() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::setFreeConstraints(const Eigen::MatrixXd& free_constraints) {
+  CHECK(static_cast<size_t>(free_constraints.rows()) == n_free_constraints_);
+  CHECK(static_cast<size_t>(free_constraints.cols()) == dimension_);
+
+  free_constraints_compact_ = free_constraints;
+  rpp_decomposition_valid_  = false;
+  updateSegmentsFromCompactConstraints();
+}
+
+//}
+
 /* setFreeConstraints() //{ */
 
 template <int _N>
@@ -503,12 +998,226 @@ void PolynomialOptimization<_N>::setFreeConstraints(const std::vector<Eigen::Vec
   for (const Eigen::VectorXd& v : free_constraints)
     CHECK(static_cast<size_t>(v.size()) == n_free_constraints_);
 
-  free_constraints_compact_ = free_constraints;
+  for (size_t d = 0; d < dimension_; ++d) {
+    free_constraints_compact_.col(d) = free_constraints[d];
+  }
+  rpp_decomposition_valid_ = false;
   updateSegmentsFromCompactConstraints();
 }
 
 //}
 
+/* getFreeConstraints() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::getFreeConstraints(std::vector<Eigen::VectorXd>* free_constraints) const {
+  CHECK(free_constraints != nullptr);
+  free_constraints->resize(dimension_);
+  for (size_t d = 0; d < dimension_; ++d) {
+    (*free_constraints)[d] = free_constraints_compact_.col(d);
+  }
+}
+
+//}
+
+/* getFixedConstraints() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::getFixedConstraints(std::vector<Eigen::VectorXd>* fixed_constraints) const {
+  CHECK(fixed_constraints != nullptr);
+  fixed_constraints->resize(dimension_);
+  for (size_t d = 0; d < dimension_; ++d) {
+    (*fixed_constraints)[d] = fixed_constraints_compact_.col(d);
+  }
+}
+
+//}
+
+/* computeCostGradients() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::computeCostGradients(Eigen::MatrixXd* gradient_free_constraints, std::vector<double>* gradient_segment_times) const {
+  CHECK_NOTNULL(gradient_free_constraints);
+  CHECK_NOTNULL(gradient_segment_times);
+
+  Eigen::MatrixXd gradient_reordered(n_all_constraints_, dimension_);
+  gradient_segment_times->assign(n_segments_, 0.0);
+
+  SegmentMatrix coefficients(N, dimension_);
+
+  for (size_t i = 0; i < n_segments_; ++i) {
+    const double segment_time = segment_times_[i];
+
+    for (size_t d = 0; d < dimension_; ++d) {
+      coefficients.col(d) = segments_[i][d].getCoefficients();
+
+      // The cost is the integral of the squared derivative over the segment,
+      // thus its change with the segment time is the integrand at the end.
+      const double value = segments_[i][d].evaluate(segment_time, derivative_to_optimize_);
+      (*gradient_segment_times)[i] += value * value;
+    }
+
+    // The corridor cost depends on the segment time through the line as
+    // well, W(T) = T * D * W(1) * D gives dW/dT = (W + J * W + W * J) / T,
+    // J = diag(0, 1, ..., N - 1).
+    if (corridor_weights_[i] > 0.0) {
+      SquareMatrix corridor_cost_matrix;
+      computeCorridorCostMatrix(segment_time, &corridor_cost_matrix);
+
+      const Eigen::Matrix<double, N, 1> exponents = Eigen::Matrix<double, N, 1>::LinSpaced(N, 0.0, N - 1.0);
+      const SquareMatrix                dW =
+          (corridor_cost_matrix + exponents.asDiagonal() * corridor_cost_matrix + corridor_cost_matrix * exponents.asDiagonal()) / segment_time;
+
+      (*gradient_segment_times)[i] += 0.5 * corridor_weights_[i] * (dW * coefficients).cwiseProduct(coefficients).sum();
+    }
+
+    // cost = 0.5 * c^T * Q * c
+    gradient_reordered.middleRows<N>(i * N) = backpropagateCoefficientGradient(i, cost_matrices_[i] * coefficients, &(*gradient_segment_times)[i]);
+  }
+
+  *gradient_free_constraints = (constraint_reordering_.transpose() * gradient_reordered).bottomRows(n_free_constraints_);
+}
+
+//}
+
+/* computeMagnitudeGradients() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::computeMagnitudeGradients(int derivative, const Extremum& extremum, Eigen::MatrixXd* gradient_free_constraints,
+                                                           std::vector<double>* gradient_segment_times) const {
+  CHECK_NOTNULL(gradient_free_constraints);
+  CHECK_NOTNULL(gradient_segment_times);
+
+  gradient_free_constraints->setZero(n_free_constraints_, dimension_);
+  gradient_segment_times->assign(n_segments_, 0.0);
+
+  if (extremum.segment_idx < 0 || extremum.segment_idx >= static_cast<int>(n_segments_)) {
+    return;
+  }
+
+  const size_t          i         = extremum.segment_idx;
+  const Eigen::VectorXd value     = segments_[i].evaluate(extremum.time, derivative);
+  const double          magnitude = value.norm();
+
+  if (magnitude <= 0.0) {
+    return;
+  }
+
+  const Eigen::VectorXd direction = value / magnitude;
+
+  const SegmentMatrix gradient_coefficients = Polynomial::baseCoeffsWithTime(N, derivative, extremum.time) * direction.transpose();
+
+  // A maximum at the end of the segment moves along with the segment time.
+  if (extremum.time >= segment_times_[i]) {
+    (*gradient_segment_times)[i] += direction.dot(segments_[i].evaluate(extremum.time, derivative + 1));
+  }
+
+  Eigen::MatrixXd gradient_reordered = Eigen::MatrixXd::Zero(n_all_constraints_, dimension_);
+  gradient_reordered.middleRows<N>(i * N) = backpropagateCoefficientGradient(i, gradient_coefficients, &(*gradient_segment_times)[i]);
+
+  *gradient_free_constraints = (constraint_reordering_.transpose() * gradient_reordered).bottomRows(n_free_constraints_);
+}
+
+//}
+
+/* computeDeviationFromLine() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::computeDeviationFromLine(size_t segment, size_t n_dimensions, SegmentMatrix* deviation) const {
+  CHECK_NOTNULL(deviation);
+
+  deviation->resize(N, n_dimensions);
+  for (size_t d = 0; d < n_dimensions; ++d) {
+    deviation->col(d) = segments_[segment][d].getCoefficients(0);
+  }
+
+  const Eigen::VectorXd start     = deviation->row(0).transpose();
+  const Eigen::VectorXd end       = segments_[segment].evaluate(segment_times_[segment], derivative_order::POSITION).head(n_dimensions);
+  const double          length    = (end - start).norm();
+  Eigen::MatrixXd       projector = Eigen::MatrixXd::Identity(n_dimensions, n_dimensions);
+
+  // The distance from a line of zero length is the distance from its start.
+  if (length > 0.0) {
+    const Eigen::VectorXd direction = (end - start) / length;
+    projector -= direction * direction.transpose();
+  }
+
+  deviation->row(0) -= start.transpose();
+  *deviation *= projector;
+}
+
+//}
+
+/* computeMaximaOfDeviation() //{ */
+
+template <int _N>
+void PolynomialOptimization<_N>::computeMaximaOfDeviation(size_t n_dimensions, std::vector<Extremum>* maxima) const {
+  CHECK_NOTNULL(maxima);
+  CHECK_GT(n_dimensions, 0u);
+  CHECK_LE(n_dimensions, dimension_);
+
+  maxima->resize(n_segments_);
+
+  ThreadPool&                 pool = ThreadPool::getGlobalPool();
+  std::vector<ExtremaScratch> scratch(pool.getNumberOfThreads());
+  pool.parallelFor(n_segments_, parallel_segment_threshold_, [&](size_t i, size_t thread_idx) {
+    SegmentMatrix deviation;
+    computeDeviationFromLine(i, n_dimensions, &deviation);
+
+    // The extrema of the distance are at the roots of the derivative of the
+    // squared distance, the sum of the convolutions of each dimension with
+    // its derivative.
+    ExtremaScratch& s = scratch[thread_idx];
+    s.convolved.resize(1);
+    Eigen::VectorXd& c = s.convolved.front();
+    c.setZero(Polynomial::getConvolutionLength(N, N - 1));
+    for (size_t d = 0; d < n_dimensions; ++d) {
+      for (int j = 0; j < N; ++j)
+        for (int k = 0; k < N - 1; ++k)
+          c[j + k] += deviation(j, d) * (k + 1) * deviation(k + 1, d);
+    }
+    if (!findRootsJenkinsTraub(c, &s.roots))
+      s.roots.resize(0);
+
+    // The candidates always start with 0 and the segment time.
+    Polynomial::selectMinMaxCandidatesFromRoots(0.0, segment_times_[i], s.roots, &s.extrema_times);
+
+    Extremum& maximum = (*maxima)[i];
+    maximum           = Extremum(0.0, 0.0, i);
+    for (double t : s.extrema_times) {
+      const Extremum candidate(t, (deviation.transpose() * Polynomial::baseCoeffsWithTime(N, derivative_order::POSITION, t)).norm(), i);
+      if (maximum < candidate)
+        maximum = candidate;
+    }
+  });
+}
+
+//}
+
+/* backpropagateCoefficientGradient() //{ */
+
+template <int _N>
+typename PolynomialOptimization<_N>::SegmentMatrix PolynomialOptimization<_N>::backpropagateCoefficientGradient(size_t               segment,
+                                                                                                               const SegmentMatrix& gradient_coefficients,
+                                                                                                               double* gradient_segment_time) const {
+  // coefficients = A^-1 * constraints
+  const SegmentMatrix gradient_constraints = inverse_mapping_matrices_[segment].transpose() * gradient_coefficients;
+
+  // d(A^-1)/dt = -A^-1 * dA/dt * A^-1, and dA/dt * coefficients are the next
+  // higher derivatives at the end of the segment (the start does not move).
+  const double segment_time = segment_times_[segment];
+
+  for (size_t d = 0; d < dimension_; ++d) {
+    for (int k = 0; k < N / 2; ++k) {
+      *gradient_segment_time -= gradient_constraints(N / 2 + k, d) * segments_[segment][d].evaluate(segment_time, k + 1);
+    }
+  }
+
+  return gradient_constraints;
+}
+
+//}
+
 /* getAInverse() //{ */
 
 template <int _N>
@@ -605,6 +1314,12 @@ void PolynomialOptimization<_N>::computeQuadraticCostJacobian(int derivative, do
 
 //}
 
+// Instantiated in polynomial_optimization_dispatch.cpp.
+extern template class PolynomialOptimization<8>;
+extern template class PolynomialOptimization<10>;
+extern template class PolynomialOptimization<12>;
+extern template class PolynomialOptimization<14>;
+
 }  // namespace eth_trajectory_generation
 
 #endif  // eth_trajectory_generation_IMPL_POLYNOMIAL_OPTIMIZATION_LINEAR_IMPL_H_
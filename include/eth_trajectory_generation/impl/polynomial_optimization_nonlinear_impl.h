@@ -35,10 +35,14 @@ inline std::ostream& operator<<(std::ostream& stream, const OptimizationInfo& va
   stream << "  cost trajectory:       " << val.cost_trajectory << std::endl;
   stream << "  cost time:             " << val.cost_time << std::endl;
   stream << "  cost soft constraints: " << val.cost_soft_constraints << std::endl;
+  stream << "  extrema cache:         " << val.extrema_cache_hits << " hits, " << val.extrema_cache_misses << " misses" << std::endl;
   stream << "  maxima: " << std::endl;
-  for (const std::pair<int, Extremum>& m : val.maxima) {
-    stream << "    " << positionDerivativeToString(m.first) << ": " << m.second.value << " in segment " << m.second.segment_idx << " and segment time "
-           << m.second.time << std::endl;
+  for (int derivative = 0; derivative <= kMaxMagnitudeDerivative; ++derivative) {
+    if (!val.maxima.isSet(derivative))
+      continue;
+    const Extremum& m = val.maxima[derivative];
+    stream << "    " << positionDerivativeToString(derivative) << ": " << m.value << " in segment " << m.segment_idx << " and segment time " << m.time
+           << std::endl;
   }
   return stream;
 }
@@ -46,6 +50,8 @@ inline std::ostream& operator<<(std::ostream& stream, const OptimizationInfo& va
 template <int _N>
 PolynomialOptimizationNonLinear<_N>::PolynomialOptimizationNonLinear(size_t dimension, const NonlinearOptimizationParameters& parameters)
     : poly_opt_(dimension), optimization_parameters_(parameters) {
+  poly_opt_.setDenseSolverThreshold(std::max(0, optimization_parameters_.dense_solver_threshold));
+  poly_opt_.setParallelSegmentThreshold(std::max(0, optimization_parameters_.parallel_segment_threshold));
 }
 
 template <int _N>
@@ -53,6 +59,10 @@ bool PolynomialOptimizationNonLinear<_N>::setupFromVertices(const Vertex::Vector
                                                             int derivative_to_optimize) {
   bool ret = poly_opt_.setupFromVertices(vertices, segment_times, derivative_to_optimize);
 
+  invalidateEvaluationCache();
+  unscaled_segment_times_.clear();
+  projected_gradient_step_ = 0.0;
+
   size_t n_optimization_parameters;
   switch (optimization_parameters_.time_alloc_method) {
     case NonlinearOptimizationParameters::kSquaredTime:
@@ -60,6 +70,11 @@ bool PolynomialOptimizationNonLinear<_N>::setupFromVertices(const Vertex::Vector
     case NonlinearOptimizationParameters::kMellingerOuterLoop:
       n_optimization_parameters = segment_times.size();
       break;
+    case NonlinearOptimizationParameters::kMellingerProjectedGradient:
+    case NonlinearOptimizationParameters::kTimeScalingOnly:
+      // nothing is optimized by nlopt
+      nlopt_.reset();
+      return ret;
     default:
       n_optimization_parameters = segment_times.size() + poly_opt_.getNumberFreeConstraints() * poly_opt_.getDimension();
       break;
@@ -71,6 +86,9 @@ bool PolynomialOptimizationNonLinear<_N>::setupFromVertices(const Vertex::Vector
   nlopt_->set_xtol_rel(optimization_parameters_.x_rel);
   nlopt_->set_xtol_abs(optimization_parameters_.x_abs);
   nlopt_->set_maxeval(optimization_parameters_.max_iterations);
+  if (optimization_parameters_.max_time > 0) {
+    nlopt_->set_maxtime(optimization_parameters_.max_time);
+  }
 
   if (optimization_parameters_.random_seed < 0)
     nlopt_srand_time();
@@ -82,6 +100,7 @@ bool PolynomialOptimizationNonLinear<_N>::setupFromVertices(const Vertex::Vector
 
 template <int _N>
 bool PolynomialOptimizationNonLinear<_N>::solveLinear() {
+  invalidateEvaluationCache();
   return poly_opt_.solveLinear();
 }
 
@@ -90,8 +109,15 @@ int PolynomialOptimizationNonLinear<_N>::optimize() {
   optimization_info_ = OptimizationInfo();
   int result         = nlopt::FAILURE;
 
+  unscaled_segment_times_.clear();
+
   const std::chrono::high_resolution_clock::time_point t_start = std::chrono::high_resolution_clock::now();
 
+  const typename PolynomialOptimization<N>::ExtremaCacheStatistics extrema_cache_start = poly_opt_.getExtremaCacheStatistics();
+
+  invalidateEvaluationCache();
+  evaluation_cache_.valid = true;
+
   switch (optimization_parameters_.time_alloc_method) {
     case NonlinearOptimizationParameters::kSquaredTime:
     case NonlinearOptimizationParameters::kRichterTime:
@@ -104,18 +130,96 @@ int PolynomialOptimizationNonLinear<_N>::optimize() {
     case NonlinearOptimizationParameters::kMellingerOuterLoop:
       result = optimizeTimeMellingerOuterLoop();
       break;
+    case NonlinearOptimizationParameters::kMellingerProjectedGradient:
+      result = optimizeTimeMellingerProjectedGradient();
+      break;
+    case NonlinearOptimizationParameters::kTimeScalingOnly:
+      result = optimizeTimeScalingOnly();
+      break;
     default:
       break;
   }
 
+  // The linear problem may be changed from outside from now on.
+  invalidateEvaluationCache();
+
   const std::chrono::high_resolution_clock::time_point t_stop = std::chrono::high_resolution_clock::now();
   optimization_info_.optimization_time                        = std::chrono::duration_cast<std::chrono::duration<double>>(t_stop - t_start).count();
 
   optimization_info_.stopping_reason = result;
 
+  const typename PolynomialOptimization<N>::ExtremaCacheStatistics extrema_cache_stop = poly_opt_.getExtremaCacheStatistics();
+
+  optimization_info_.extrema_cache_hits   = extrema_cache_stop.hits - extrema_cache_start.hits;
+  optimization_info_.extrema_cache_misses = extrema_cache_stop.misses - extrema_cache_start.misses;
+
   return result;
 }
 
+template <int _N>
+bool PolynomialOptimizationNonLinear<_N>::updateStartVertex(const Vertex& start, size_t n_consumed_segments, double first_segment_time) {
+  std::vector<double> segment_times;
+  poly_opt_.getSegmentTimes(&segment_times);
+  CHECK_LT(n_consumed_segments, segment_times.size());
+
+  // The remaining part of the first segment keeps its share of the segment.
+  if (unscaled_segment_times_.size() == segment_times.size()) {
+    first_segment_time *= unscaled_segment_times_[n_consumed_segments] / segment_times[n_consumed_segments];
+    segment_times = unscaled_segment_times_;
+  }
+
+  segment_times.erase(segment_times.begin(), segment_times.begin() + n_consumed_segments);
+  segment_times.front() = std::max(first_segment_time, kOptimizationTimeLowerBound);
+  unscaled_segment_times_.clear();
+
+  invalidateEvaluationCache();
+
+  // The structure of the problem does not change.
+  if (n_consumed_segments == 0 && poly_opt_.updateStartVertex(start)) {
+    poly_opt_.updateSegmentTimes(segment_times);
+    return true;
+  }
+
+  Vertex::Vector vertices;
+  poly_opt_.getVertices(&vertices);
+  vertices.erase(vertices.begin(), vertices.begin() + n_consumed_segments);
+  vertices.front() = start;
+
+  const double projected_gradient_step = projected_gradient_step_;
+
+  if (!setupFromVertices(vertices, segment_times, poly_opt_.getDerivativeToOptimize())) {
+    return false;
+  }
+
+  projected_gradient_step_ = projected_gradient_step;
+
+  // The new nlopt instance needs the hard constraints again.
+  if (nlopt_ && !optimization_parameters_.use_soft_constraints) {
+    for (const std::shared_ptr<ConstraintData>& constraint_data : inequality_constraints_) {
+      try {
+        nlopt_->add_inequality_constraint(&PolynomialOptimizationNonLinear<N>::evaluateMaximumMagnitudeConstraint, constraint_data.get(),
+                                          optimization_parameters_.inequality_constraint_tolerance);
+      }
+      catch (std::exception& e) {
+        LOG(ERROR) << "ERROR while setting inequality constraint " << e.what() << std::endl;
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+template <int _N>
+void PolynomialOptimizationNonLinear<_N>::setMaxTime(double max_time) {
+  optimization_parameters_.max_time = max_time;
+
+  // nlopt disables the limit if it is not positive as well
+  if (nlopt_) {
+    nlopt_->set_maxtime(max_time);
+  }
+}
+
 template <int _N>
 int PolynomialOptimizationNonLinear<_N>::optimizeTime() {
   std::vector<double> initial_step, segment_times;
@@ -152,6 +256,13 @@ int PolynomialOptimizationNonLinear<_N>::optimizeTime() {
     return nlopt::FAILURE;
   }
 
+  // The last evaluation is not necessarily the best one, e.g. when stopped
+  // at the maximum time.
+  setOptimizationVariables(segment_times);
+
+  invalidateEvaluationCache();
+  fitCorridor();
+
   return result;
 }
 
@@ -206,10 +317,15 @@ int PolynomialOptimizationNonLinear<_N>::optimizeTimeMellingerOuterLoop() {
     }
   }
 
+  // The last evaluation is not necessarily the best one, e.g. when stopped
+  // at the maximum time.
+  setOptimizationVariables(segment_times);
+
   // Scaling of segment times
   std::vector<double> relative_segment_times;
   poly_opt_.getSegmentTimes(&relative_segment_times);
-  scaleSegmentTimesWithViolation();
+  invalidateEvaluationCache();
+  fitCorridorAndScaleSegmentTimes();
   std::vector<double> scaled_segment_times;
   poly_opt_.getSegmentTimes(&scaled_segment_times);
 
@@ -232,6 +348,181 @@ int PolynomialOptimizationNonLinear<_N>::optimizeTimeMellingerOuterLoop() {
   return result;
 }
 
+template <int _N>
+int PolynomialOptimizationNonLinear<_N>::optimizeTimeMellingerProjectedGradient() {
+  // Sufficient decrease of the backtracking line search (Armijo).
+  const double kSufficientDecrease   = 1.0e-4;
+  const int    kMaxBacktrackingSteps = 20;
+  // The segment times are converged, once a step changes none of them by
+  // more than this fraction of the mean segment time.
+  const double kSegmentTimeTolerance = 1.0e-3;
+
+  std::vector<double> original_segment_times;
+  poly_opt_.getSegmentTimes(&original_segment_times);
+  const size_t n_segments = original_segment_times.size();
+
+  Eigen::VectorXd segment_times     = Eigen::Map<const Eigen::VectorXd>(original_segment_times.data(), n_segments);
+  const double    total_time        = segment_times.sum();
+  const double    mean_segment_time = total_time / n_segments;
+
+  int result = nlopt::SUCCESS;
+
+  const std::chrono::high_resolution_clock::time_point t_start = std::chrono::high_resolution_clock::now();
+
+  // A single segment, or segments all at the lower bound, leave nothing to
+  // distribute.
+  if (n_segments > 1 && total_time > n_segments * kOptimizationTimeLowerBound) {
+    projectSegmentTimes(total_time, &segment_times);
+
+    std::vector<double> gradient_segment_times;
+    Eigen::MatrixXd     gradient_free_constraints;
+
+    double cost = evaluateSegmentTimes(segment_times);
+    poly_opt_.computeCostGradients(&gradient_free_constraints, &gradient_segment_times);
+    Eigen::VectorXd gradient = Eigen::Map<const Eigen::VectorXd>(gradient_segment_times.data(), n_segments);
+
+    // Only the part of the gradient along the total time is taken out by the
+    // projection, the first step moves the segment times by
+    // initial_stepsize_rel of their mean.
+    const double initial_step = std::max(optimization_parameters_.initial_stepsize_rel, 1.0e-3) * mean_segment_time /
+                                std::max((gradient.array() - gradient.mean()).abs().maxCoeff(), std::numeric_limits<double>::epsilon());
+    double step = projected_gradient_step_ > 0.0 ? projected_gradient_step_ : initial_step;
+
+    result = nlopt::MAXEVAL_REACHED;
+    while (optimization_parameters_.max_iterations < 0 || optimization_info_.n_iterations < optimization_parameters_.max_iterations) {
+      if (optimization_parameters_.max_time > 0 &&
+          std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t_start).count() >= optimization_parameters_.max_time) {
+        result = nlopt::MAXTIME_REACHED;
+        break;
+      }
+
+      Eigen::VectorXd projected = segment_times - step * gradient;
+      projectSegmentTimes(total_time, &projected);
+      const Eigen::VectorXd direction = projected - segment_times;
+
+      if (direction.lpNorm<Eigen::Infinity>() <= kSegmentTimeTolerance * mean_segment_time) {
+        result = nlopt::XTOL_REACHED;
+        break;
+      }
+
+      // The set of feasible segment times is convex, so is every point
+      // between the current and the projected ones.
+      const double    slope = gradient.dot(direction);
+      double          alpha = 1.0;
+      Eigen::VectorXd new_segment_times;
+      double          new_cost;
+      for (int i = 0;; ++i) {
+        new_segment_times = segment_times + alpha * direction;
+        new_cost          = evaluateSegmentTimes(new_segment_times);
+        if (new_cost <= cost + kSufficientDecrease * alpha * slope || i + 1 >= kMaxBacktrackingSteps) {
+          break;
+        }
+        alpha *= 0.5;
+      }
+
+      if (new_cost >= cost) {
+        result = nlopt::ROUNDOFF_LIMITED;
+        break;
+      }
+
+      poly_opt_.computeCostGradients(&gradient_free_constraints, &gradient_segment_times);
+      const Eigen::VectorXd new_gradient = Eigen::Map<const Eigen::VectorXd>(gradient_segment_times.data(), n_segments);
+
+      // Barzilai-Borwein step length for the next iteration.
+      const Eigen::VectorXd s  = new_segment_times - segment_times;
+      const double          sy = s.dot(new_gradient - gradient);
+      step                     = sy > 0.0 ? s.squaredNorm() / sy : initial_step;
+
+      const double cost_change = cost - new_cost;
+      segment_times            = new_segment_times;
+      cost                     = new_cost;
+      gradient                 = new_gradient;
+
+      if ((optimization_parameters_.f_rel > 0 && cost_change <= optimization_parameters_.f_rel * std::abs(cost)) ||
+          (optimization_parameters_.f_abs > 0 && cost_change <= optimization_parameters_.f_abs)) {
+        result = nlopt::FTOL_REACHED;
+        break;
+      }
+    }
+
+    // The last evaluation may have been a rejected step.
+    evaluateSegmentTimes(segment_times);
+
+    projected_gradient_step_ = step;
+  } else {
+    poly_opt_.solveLinear();
+  }
+
+  std::vector<double> relative_segment_times;
+  poly_opt_.getSegmentTimes(&relative_segment_times);
+  invalidateEvaluationCache();
+  fitCorridorAndScaleSegmentTimes();
+
+  if (optimization_parameters_.print_debug_info_time_allocation) {
+    std::vector<double> scaled_segment_times;
+    poly_opt_.getSegmentTimes(&scaled_segment_times);
+    std::cout << "[MEL PG   Trajectory Time] Before: " << total_time
+              << " | After Rel Change: " << std::accumulate(relative_segment_times.begin(), relative_segment_times.end(), 0.0)
+              << " | After Scaling: " << std::accumulate(scaled_segment_times.begin(), scaled_segment_times.end(), 0.0) << std::endl;
+  }
+
+  return result;
+}
+
+template <int _N>
+int PolynomialOptimizationNonLinear<_N>::optimizeTimeScalingOnly() {
+  poly_opt_.solveLinear();
+  fitCorridorAndScaleSegmentTimes();
+
+  optimization_info_.n_iterations    = 1;
+  optimization_info_.cost_trajectory = poly_opt_.computeCost();
+
+  return nlopt::SUCCESS;
+}
+
+template <int _N>
+double PolynomialOptimizationNonLinear<_N>::evaluateSegmentTimes(const Eigen::VectorXd& segment_times) {
+  setOptimizationVariables(std::vector<double>(segment_times.data(), segment_times.data() + segment_times.size()));
+  const double cost_trajectory = poly_opt_.computeCost();
+
+  if (optimization_parameters_.print_debug_info) {
+    std::cout << "---- cost at iteration " << optimization_info_.n_iterations << "---- " << std::endl;
+    std::cout << "  segment times: " << segment_times.transpose() << std::endl;
+    std::cout << "  sum: " << cost_trajectory << std::endl;
+  }
+
+  optimization_info_.n_iterations++;
+  optimization_info_.cost_trajectory = cost_trajectory;
+
+  return cost_trajectory;
+}
+
+template <int _N>
+void PolynomialOptimizationNonLinear<_N>::projectSegmentTimes(double total_time, Eigen::VectorXd* segment_times) {
+  CHECK_NOTNULL(segment_times);
+  const int    n_segments = segment_times->size();
+  const double excess     = std::max(0.0, total_time - n_segments * kOptimizationTimeLowerBound);
+
+  // Euclidean projection of the times above the lower bound onto the
+  // simplex of the excess time: all of them are shifted by the same
+  // threshold, those below it end up at the lower bound.
+  Eigen::VectorXd above  = segment_times->array() - kOptimizationTimeLowerBound;
+  Eigen::VectorXd sorted = above;
+  std::sort(sorted.data(), sorted.data() + n_segments, std::greater<double>());
+
+  double sum       = 0.0;
+  double threshold = sorted[0] - excess;
+  for (int i = 0; i < n_segments; ++i) {
+    sum += sorted[i];
+    const double candidate = (sum - excess) / (i + 1);
+    if (sorted[i] - candidate > 0.0) {
+      threshold = candidate;
+    }
+  }
+
+  *segment_times = (above.array() - threshold).max(0.0) + kOptimizationTimeLowerBound;
+}
+
 template <int _N>
 double PolynomialOptimizationNonLinear<_N>::getCost() const {
   return poly_opt_.computeCost();
@@ -275,16 +566,44 @@ double PolynomialOptimizationNonLinear<_N>::getCostAndGradientMellinger(std::vec
     gradients->clear();
     gradients->resize(n_segments);
 
+    const double increment_time = 0.1;
+
+    // Deduct h*(-1/(m-2)) according to paper Mellinger "Minimum snap
+    // trajectory generation and control for quadrotors"
+    const double const_traj_time_corr = increment_time / (n_segments - 1.0);
+
+    bool gradients_computed = false;
+
+    if (optimization_parameters_.use_segment_time_updates) {
+
+      // The correction of the other segments is applied to all segments at
+      // once, the increment of a segment is then a change of this single
+      // segment, which updates the decomposition of this problem.
+      std::vector<double> segment_times_corrected(n_segments);
+      for (size_t i = 0; i < n_segments; ++i) {
+        segment_times_corrected[i] = std::max(kOptimizationTimeLowerBound, segment_times[i] - const_traj_time_corr);
+      }
+
+      poly_opt_.updateSegmentTimes(segment_times_corrected);
+      poly_opt_.solveLinear();
+
+      const double J_d_corrected = poly_opt_.computeCost();
+
+      gradients_computed = true;
+      for (size_t n = 0; n < n_segments && gradients_computed; ++n) {
+        double cost_change;
+        gradients_computed = poly_opt_.computeCostChangeOfSegmentTime(
+            n, std::max(kOptimizationTimeLowerBound, segment_times[n] + increment_time), &cost_change);
+        gradients->at(n) = (J_d_corrected + cost_change - J_d) / increment_time;
+      }
+    }
+
     // Initialize changed segment times for numerical derivative
     std::vector<double> segment_times_bigger(n_segments);
-    const double        increment_time = 0.1;
-    for (size_t n = 0; n < n_segments; ++n) {
+    for (size_t n = 0; n < n_segments && !gradients_computed; ++n) {
       // Now the same with an increased segment time
       // Calculate cost with higher segment time
       segment_times_bigger = segment_times;
-      // Deduct h*(-1/(m-2)) according to paper Mellinger "Minimum snap
-      // trajectory generation and control for quadrotors"
-      double const_traj_time_corr = increment_time / (n_segments - 1.0);
       for (size_t i = 0; i < segment_times_bigger.size(); ++i) {
         if (i == n) {
           segment_times_bigger[i] += increment_time;
@@ -333,6 +652,8 @@ double PolynomialOptimizationNonLinear<_N>::getCostAndGradientMellinger(std::vec
 
 template <int _N>
 void PolynomialOptimizationNonLinear<_N>::scaleSegmentTimesWithViolation() {
+  poly_opt_.getSegmentTimes(&unscaled_segment_times_);
+
   // Get trajectory
   Trajectory traj;
   poly_opt_.getTrajectory(&traj);
@@ -369,6 +690,71 @@ void PolynomialOptimizationNonLinear<_N>::scaleSegmentTimesWithViolation() {
   }
 }
 
+template <int _N>
+bool PolynomialOptimizationNonLinear<_N>::fitCorridor() {
+  if (corridor_maximum_deviation_ <= 0.0) {
+    return false;
+  }
+
+  // Only the position is kept in the corridor.
+  const size_t n_dimensions           = poly_opt_.getDimension();
+  const size_t first_segment          = corridor_first_segment_ ? 0 : 1;
+  const int    derivative_to_optimize = poly_opt_.getDerivativeToOptimize();
+
+  std::vector<double> segment_times, corridor_weights;
+  poly_opt_.getSegmentTimes(&segment_times);
+  poly_opt_.getCorridorWeights(&corridor_weights);
+
+  std::vector<Extremum> maxima;
+  bool                  changed = false;
+
+  for (int i = 0; i < kMaxCorridorIterations; ++i) {
+    poly_opt_.computeMaximaOfDeviation(n_dimensions, &maxima);
+
+    bool inside = true;
+    for (size_t j = first_segment; j < maxima.size(); ++j) {
+      const double violation = maxima[j].value / corridor_maximum_deviation_;
+      if (violation <= 1.0) {
+        continue;
+      }
+      inside = false;
+
+      // The first weight makes the corridor cost comparable to the cost of
+      // the derivative, which scales with T^(-2 * derivative) relative to
+      // the squared deviation. Raised at least twice afterwards.
+      if (corridor_weights[j] > 0.0) {
+        corridor_weights[j] *= std::max(violation * violation, 2.0);
+      } else {
+        corridor_weights[j] = violation * violation * std::pow(segment_times[j], -2.0 * derivative_to_optimize);
+      }
+    }
+
+    if (inside) {
+      break;
+    }
+
+    poly_opt_.setCorridorWeights(corridor_weights);
+    poly_opt_.solveLinear();
+    changed = true;
+  }
+
+  return changed;
+}
+
+template <int _N>
+void PolynomialOptimizationNonLinear<_N>::fitCorridorAndScaleSegmentTimes() {
+  fitCorridor();
+  scaleSegmentTimesWithViolation();
+
+  // Re-planning starts from the times before the first scaling.
+  const std::vector<double> unscaled_segment_times = unscaled_segment_times_;
+
+  if (fitCorridor()) {
+    scaleSegmentTimesWithViolation();
+    unscaled_segment_times_ = unscaled_segment_times;
+  }
+}
+
 template <int _N>
 int PolynomialOptimizationNonLinear<_N>::optimizeTimeAndFreeConstraints() {
   std::vector<double> initial_step, initial_solution, segment_times, lower_bounds, upper_bounds;
@@ -378,13 +764,13 @@ int PolynomialOptimizationNonLinear<_N>::optimizeTimeAndFreeConstraints() {
 
   // compute initial solution
   poly_opt_.solveLinear();
-  std::vector<Eigen::VectorXd> free_constraints;
+  Eigen::MatrixXd free_constraints;
   poly_opt_.getFreeConstraints(&free_constraints);
-  if (free_constraints.size() == 0 || free_constraints.front().size() == 0) {
+  if (free_constraints.size() == 0) {
     LOG(WARNING) << "No free derivative variables, same as time-only optimization.";
   }
 
-  const size_t n_optimization_variables = n_segments + free_constraints.size() * free_constraints.front().size();
+  const size_t n_optimization_variables = n_segments + free_constraints.size();
 
   CHECK_GT(n_optimization_variables, 0u);
 
@@ -398,15 +784,13 @@ int PolynomialOptimizationNonLinear<_N>::optimizeTimeAndFreeConstraints() {
     initial_solution.push_back(t);
   }
 
-  for (const Eigen::VectorXd& c : free_constraints) {
-    for (int i = 0; i < c.size(); ++i) {
-      initial_solution.push_back(c[i]);
-    }
-  }
+  // The free constraints are stored column-wise per dimension, which matches
+  // the layout of the optimization variables.
+  initial_solution.insert(initial_solution.end(), free_constraints.data(), free_constraints.data() + free_constraints.size());
 
   // Setup for getting bounds on the free endpoint derivatives
   std::vector<double> lower_bounds_free, upper_bounds_free;
-  const size_t        n_optimization_variables_free = free_constraints.size() * free_constraints.front().size();
+  const size_t        n_optimization_variables_free = free_constraints.size();
   lower_bounds_free.reserve(n_optimization_variables_free);
   upper_bounds_free.reserve(n_optimization_variables_free);
 
@@ -475,12 +859,17 @@ int PolynomialOptimizationNonLinear<_N>::optimizeTimeAndFreeConstraints() {
     return nlopt::FAILURE;
   }
 
+  // The last evaluation is not necessarily the best one, e.g. when stopped
+  // at the maximum time.
+  setOptimizationVariables(initial_solution);
+
   return result;
 }
 
 template <int _N>
 bool PolynomialOptimizationNonLinear<_N>::addMaximumMagnitudeConstraint(int derivative, double maximum_value) {
   CHECK_GE(derivative, 0);
+  CHECK_LE(derivative, kMaxMagnitudeDerivative);
   CHECK_GE(maximum_value, 0.0);
 
   std::shared_ptr<ConstraintData> constraint_data(new ConstraintData);
@@ -491,7 +880,8 @@ bool PolynomialOptimizationNonLinear<_N>::addMaximumMagnitudeConstraint(int deri
   // Store the shared_ptrs such that their data will be destroyed later.
   inequality_constraints_.push_back(constraint_data);
 
-  if (!optimization_parameters_.use_soft_constraints) {
+  // the projected gradient and the time scaling read the constraints directly
+  if (!optimization_parameters_.use_soft_constraints && nlopt_) {
     try {
       nlopt_->add_inequality_constraint(&PolynomialOptimizationNonLinear<N>::evaluateMaximumMagnitudeConstraint, constraint_data.get(),
                                         optimization_parameters_.inequality_constraint_tolerance);
@@ -504,6 +894,22 @@ bool PolynomialOptimizationNonLinear<_N>::addMaximumMagnitudeConstraint(int deri
   return true;
 }
 
+template <int _N>
+bool PolynomialOptimizationNonLinear<_N>::addCorridorConstraint(double maximum_deviation, bool first_segment) {
+  CHECK_GT(maximum_deviation, 0.0);
+
+  // the corridor cost is shared by all the dimensions, it would pull e.g. the heading as well
+  if (poly_opt_.getDimension() > 3) {
+    LOG(ERROR) << "the corridor is supported only up to 3 dimensions, got " << poly_opt_.getDimension() << std::endl;
+    return false;
+  }
+
+  corridor_maximum_deviation_ = maximum_deviation;
+  corridor_first_segment_     = first_segment;
+
+  return true;
+}
+
 template <int _N>
 double PolynomialOptimizationNonLinear<_N>::objectiveFunctionTime(const std::vector<double>& segment_times, std::vector<double>& gradient, void* data) {
   CHECK(gradient.empty()) << "computing gradient not possible, choose a gradient free method";
@@ -513,8 +919,7 @@ double PolynomialOptimizationNonLinear<_N>::objectiveFunctionTime(const std::vec
 
   CHECK_EQ(segment_times.size(), optimization_data->poly_opt_.getNumberSegments());
 
-  optimization_data->poly_opt_.updateSegmentTimes(segment_times);
-  optimization_data->poly_opt_.solveLinear();
+  optimization_data->setOptimizationVariables(segment_times);
   double       cost_trajectory  = optimization_data->poly_opt_.computeCost();
   double       cost_time        = 0;
   double       cost_constraints = 0;
@@ -563,8 +968,8 @@ double PolynomialOptimizationNonLinear<_N>::objectiveFunctionTimeMellingerOuterL
 
   CHECK_EQ(segment_times.size(), optimization_data->poly_opt_.getNumberSegments());
 
-  optimization_data->poly_opt_.updateSegmentTimes(segment_times);
-  optimization_data->poly_opt_.solveLinear();
+  // The numerical gradient perturbs the segment times, but restores them.
+  optimization_data->setOptimizationVariables(segment_times);
   double cost_trajectory;
   if (!gradient.empty()) {
     cost_trajectory = optimization_data->getCostAndGradientMellinger(&gradient);
@@ -590,7 +995,6 @@ double PolynomialOptimizationNonLinear<_N>::objectiveFunctionTimeMellingerOuterL
 
 template <int _N>
 double PolynomialOptimizationNonLinear<_N>::objectiveFunctionTimeAndConstraints(const std::vector<double>& x, std::vector<double>& gradient, void* data) {
-  CHECK(gradient.empty()) << "computing gradient not possible, choose a gradient-free method";
   CHECK_NOTNULL(data);
 
   PolynomialOptimizationNonLinear<N>* optimization_data = static_cast<PolynomialOptimizationNonLinear<N>*>(data);  // wheee ...
@@ -601,39 +1005,24 @@ double PolynomialOptimizationNonLinear<_N>::objectiveFunctionTimeAndConstraints(
 
   CHECK_EQ(x.size(), n_segments + n_free_constraints * dim);
 
-  std::vector<Eigen::VectorXd> free_constraints;
-  free_constraints.resize(dim);
-  std::vector<double> segment_times;
-  segment_times.reserve(n_segments);
-
-  for (size_t i = 0; i < n_segments; ++i) {
-    segment_times.push_back(x[i]);
-  }
+  optimization_data->setOptimizationVariables(x);
 
-  for (size_t d = 0; d < dim; ++d) {
-    const size_t idx_start = n_segments + d * n_free_constraints;
-
-    Eigen::VectorXd& free_constraints_dim = free_constraints[d];
-    free_constraints_dim.resize(n_free_constraints, Eigen::NoChange);
-    for (size_t i = 0; i < n_free_constraints; ++i) {
-      free_constraints_dim[i] = x[idx_start + i];
-    }
-  }
-
-  optimization_data->poly_opt_.updateSegmentTimes(segment_times);
-  optimization_data->poly_opt_.setFreeConstraints(free_constraints);
+  const std::vector<double> segment_times(x.begin(), x.begin() + n_segments);
 
   double cost_trajectory  = optimization_data->poly_opt_.computeCost();
   double cost_time        = 0;
   double cost_constraints = 0;
 
-  const double total_time = computeTotalTrajectoryTime(segment_times);
+  const double total_time    = computeTotalTrajectoryTime(segment_times);
+  double       gradient_time = 0;
   switch (optimization_data->optimization_parameters_.time_alloc_method) {
     case NonlinearOptimizationParameters::kRichterTimeAndConstraints:
-      cost_time = total_time * optimization_data->optimization_parameters_.time_penalty;
+      cost_time     = total_time * optimization_data->optimization_parameters_.time_penalty;
+      gradient_time = optimization_data->optimization_parameters_.time_penalty;
       break;
     default:  // kSquaredTimeAndConstraints
-      cost_time = total_time * total_time * optimization_data->optimization_parameters_.time_penalty;
+      cost_time     = total_time * total_time * optimization_data->optimization_parameters_.time_penalty;
+      gradient_time = 2.0 * total_time * optimization_data->optimization_parameters_.time_penalty;
       break;
   }
 
@@ -648,6 +1037,26 @@ double PolynomialOptimizationNonLinear<_N>::objectiveFunctionTimeAndConstraints(
                                                                                    optimization_data->optimization_parameters_.soft_constraint_weight);
   }
 
+  if (!gradient.empty()) {
+    CHECK_EQ(gradient.size(), x.size());
+
+    Eigen::MatrixXd     gradient_free_constraints;
+    std::vector<double> gradient_segment_times;
+    optimization_data->poly_opt_.computeCostGradients(&gradient_free_constraints, &gradient_segment_times);
+
+    for (double& g : gradient_segment_times) {
+      g += gradient_time;
+    }
+
+    if (optimization_data->optimization_parameters_.use_soft_constraints) {
+      optimization_data->addMaximumMagnitudeSoftConstraintGradients(optimization_data->optimization_parameters_.soft_constraint_weight,
+                                                                    &gradient_free_constraints, &gradient_segment_times);
+    }
+
+    std::copy(gradient_segment_times.begin(), gradient_segment_times.end(), gradient.begin());
+    Eigen::Map<Eigen::MatrixXd>(gradient.data() + n_segments, n_free_constraints, dim) = gradient_free_constraints;
+  }
+
   if (optimization_data->optimization_parameters_.print_debug_info) {
     std::cout << "  sum: " << cost_trajectory + cost_time + cost_constraints << std::endl;
     std::cout << "  total time: " << total_time << std::endl;
@@ -664,15 +1073,35 @@ double PolynomialOptimizationNonLinear<_N>::objectiveFunctionTimeAndConstraints(
 template <int _N>
 double PolynomialOptimizationNonLinear<_N>::evaluateMaximumMagnitudeConstraint(const std::vector<double>& segment_times, std::vector<double>& gradient,
                                                                                void* data) {
-  CHECK(gradient.empty()) << "computing gradient not possible, choose a gradient-free method";
   ConstraintData*                     constraint_data   = static_cast<ConstraintData*>(data);  // wheee ...
   PolynomialOptimizationNonLinear<N>* optimization_data = constraint_data->this_object;
 
-  Extremum max;
-  max = optimization_data->poly_opt_.computeMaximumOfMagnitude(constraint_data->derivative, nullptr);
+  // Called by nlopt with the current optimization variables, or without
+  // them for the state left behind by the objective.
+  if (!segment_times.empty()) {
+    optimization_data->setOptimizationVariables(segment_times);
+  }
+
+  const Extremum max = optimization_data->getMaximumOfMagnitude(constraint_data->derivative);
 
   optimization_data->optimization_info_.maxima[constraint_data->derivative] = max;
 
+  if (!gradient.empty()) {
+    const size_t n_segments         = optimization_data->poly_opt_.getNumberSegments();
+    const size_t n_free_constraints = optimization_data->poly_opt_.getNumberFreeConstraints();
+    const size_t dim                = optimization_data->poly_opt_.getDimension();
+
+    CHECK_EQ(gradient.size(), n_segments + n_free_constraints * dim)
+        << "computing gradient only possible when optimizing the free constraints, choose a gradient-free method";
+
+    Eigen::MatrixXd     gradient_free_constraints;
+    std::vector<double> gradient_segment_times;
+    optimization_data->poly_opt_.computeMagnitudeGradients(constraint_data->derivative, max, &gradient_free_constraints, &gradient_segment_times);
+
+    std::copy(gradient_segment_times.begin(), gradient_segment_times.end(), gradient.begin());
+    Eigen::Map<Eigen::MatrixXd>(gradient.data() + n_segments, n_free_constraints, dim) = gradient_free_constraints;
+  }
+
   return max.value - constraint_data->value;
 }
 
@@ -701,6 +1130,66 @@ double PolynomialOptimizationNonLinear<_N>::evaluateMaximumMagnitudeAsSoftConstr
   return cost;
 }
 
+template <int _N>
+void PolynomialOptimizationNonLinear<_N>::addMaximumMagnitudeSoftConstraintGradients(double weight, Eigen::MatrixXd* gradient_free_constraints,
+                                                                                     std::vector<double>* gradient_segment_times, double maximum_cost) const {
+  CHECK_NOTNULL(gradient_free_constraints);
+  CHECK_NOTNULL(gradient_segment_times);
+
+  // Relative width of the soft maximum, maxima of segments closer than this to
+  // the global maximum share its gradient.
+  constexpr double kSoftMaximumWidth = 0.02;
+
+  Eigen::MatrixXd       gradient_free_constraints_max;
+  std::vector<double>   gradient_segment_times_max;
+  std::vector<Extremum> candidates;
+
+  for (std::shared_ptr<const ConstraintData> constraint : inequality_constraints_) {
+    const Extremum maximum = getMaximumOfMagnitude(constraint->derivative, &candidates);
+
+    // The cost is clamped at maximum_cost, where it does not change anymore.
+    const double relative_violation = (maximum.value - constraint->value) / constraint->value;
+    const double current_cost       = exp(relative_violation * weight);
+    if (current_cost >= maximum_cost || maximum.value <= 0.0) {
+      continue;
+    }
+
+    const double gradient_maximum = current_cost * weight / constraint->value;
+
+    // The maximum over the segments is not differentiable where it jumps
+    // between segments, which stalls gradient-based methods. Its gradient is
+    // thus approximated by the one of a soft maximum (log-sum-exp) over the
+    // maxima of the individual segments.
+    std::vector<Extremum> segment_maxima(poly_opt_.getNumberSegments(), Extremum(0.0, 0.0, -1));
+    for (const Extremum& candidate : candidates) {
+      if (segment_maxima[candidate.segment_idx] < candidate) {
+        segment_maxima[candidate.segment_idx] = candidate;
+      }
+    }
+
+    std::vector<double> soft_weights(segment_maxima.size(), 0.0);
+    double              soft_weights_sum = 0.0;
+    for (size_t i = 0; i < segment_maxima.size(); ++i) {
+      soft_weights[i] = exp((segment_maxima[i].value - maximum.value) / (kSoftMaximumWidth * maximum.value));
+      soft_weights_sum += soft_weights[i];
+    }
+
+    for (size_t i = 0; i < segment_maxima.size(); ++i) {
+      const double soft_weight = soft_weights[i] / soft_weights_sum;
+      if (soft_weight < 1.0e-6 || segment_maxima[i].segment_idx < 0) {
+        continue;
+      }
+
+      poly_opt_.computeMagnitudeGradients(constraint->derivative, segment_maxima[i], &gradient_free_constraints_max, &gradient_segment_times_max);
+
+      *gradient_free_constraints += gradient_maximum * soft_weight * gradient_free_constraints_max;
+      for (size_t j = 0; j < gradient_segment_times->size(); ++j) {
+        (*gradient_segment_times)[j] += gradient_maximum * soft_weight * gradient_segment_times_max[j];
+      }
+    }
+  }
+}
+
 template <int _N>
 void PolynomialOptimizationNonLinear<_N>::setFreeEndpointDerivativeHardConstraints(const Vertex::Vector& vertices, std::vector<double>* lower_bounds,
                                                                                    std::vector<double>* upper_bounds) {
@@ -744,6 +1233,70 @@ void PolynomialOptimizationNonLinear<_N>::setFreeEndpointDerivativeHardConstrain
   }
 }
 
+template <int _N>
+bool PolynomialOptimizationNonLinear<_N>::setOptimizationVariables(const std::vector<double>& optimization_variables) {
+  if (evaluation_cache_.valid && optimization_variables == evaluation_cache_.optimization_variables) {
+    return false;
+  }
+
+  const size_t n_segments = poly_opt_.getNumberSegments();
+
+  switch (optimization_parameters_.time_alloc_method) {
+    case NonlinearOptimizationParameters::kSquaredTimeAndConstraints:
+    case NonlinearOptimizationParameters::kRichterTimeAndConstraints: {
+      const size_t n_free_constraints = poly_opt_.getNumberFreeConstraints();
+      const size_t dim                = poly_opt_.getDimension();
+      CHECK_EQ(optimization_variables.size(), n_segments + n_free_constraints * dim);
+
+      // The derivatives of each dimension are stacked one after another,
+      // which is the column-major layout of the (n_free_constraints x dim)
+      // matrix.
+      const Eigen::Map<const Eigen::MatrixXd> free_constraints(optimization_variables.data() + n_segments, n_free_constraints, dim);
+
+      poly_opt_.updateSegmentTimes(std::vector<double>(optimization_variables.begin(), optimization_variables.begin() + n_segments));
+      poly_opt_.setFreeConstraints(free_constraints);
+      break;
+    }
+    default:  // only the segment times
+      CHECK_EQ(optimization_variables.size(), n_segments);
+      poly_opt_.updateSegmentTimes(optimization_variables);
+      poly_opt_.solveLinear();
+      break;
+  }
+
+  const bool valid = evaluation_cache_.valid;
+  invalidateEvaluationCache();
+  evaluation_cache_.valid                  = valid;
+  evaluation_cache_.optimization_variables = optimization_variables;
+
+  return true;
+}
+
+template <int _N>
+Extremum PolynomialOptimizationNonLinear<_N>::getMaximumOfMagnitude(int derivative, std::vector<Extremum>* candidates) const {
+  if (!evaluation_cache_.valid || !evaluation_cache_.maxima_valid || !evaluation_cache_.maxima.isSet(derivative)) {
+    // All constraints are evaluated at the same variables, so their maxima
+    // are found in a single sweep over the segments.
+    std::vector<int> derivatives(1, derivative);
+    for (const std::shared_ptr<ConstraintData>& constraint : inequality_constraints_)
+      derivatives.push_back(constraint->derivative);
+
+    poly_opt_.computeMaximaOfMagnitude(derivatives, &evaluation_cache_.maxima, &evaluation_cache_.candidates);
+    evaluation_cache_.maxima_valid = evaluation_cache_.valid;
+  }
+
+  if (candidates != nullptr) {
+    *candidates = evaluation_cache_.candidates[derivative];
+  }
+
+  return evaluation_cache_.maxima[derivative];
+}
+
+template <int _N>
+void PolynomialOptimizationNonLinear<_N>::invalidateEvaluationCache() {
+  evaluation_cache_ = EvaluationCache();
+}
+
 template <int _N>
 double PolynomialOptimizationNonLinear<_N>::computeTotalTrajectoryTime(const std::vector<double>& segment_times) {
   double total_time = 0;
@@ -752,6 +1305,12 @@ double PolynomialOptimizationNonLinear<_N>::computeTotalTrajectoryTime(const std
   return total_time;
 }
 
+// Instantiated in polynomial_optimization_dispatch.cpp.
+extern template class PolynomialOptimizationNonLinear<8>;
+extern template class PolynomialOptimizationNonLinear<10>;
+extern template class PolynomialOptimizationNonLinear<12>;
+extern template class PolynomialOptimizationNonLinear<14>;
+
 }  // namespace eth_trajectory_generation
 
 namespace nlopt
@@ -0,0 +1,269 @@
+#ifndef ETH_TRAJECTORY_GENERATION_IMPL_POLYNOMIAL_OPTIMIZATION_SINGLE_SEGMENT_IMPL_H_
+#define ETH_TRAJECTORY_GENERATION_IMPL_POLYNOMIAL_OPTIMIZATION_SINGLE_SEGMENT_IMPL_H_
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include <eth_trajectory_generation/misc.h>
+
+namespace eth_trajectory_generation
+{
+
+/* PolynomialOptimizationSingleSegment() //{ */
+
+template <int _N>
+PolynomialOptimizationSingleSegment<_N>::PolynomialOptimizationSingleSegment(size_t dimension)
+    : dimension_(dimension), derivative_to_optimize_(derivative_order::INVALID), segment_time_(0.0), rest_to_rest_(true) {
+  CHECK_GT(dimension_, 0u);
+}
+
+//}
+
+/* setupFromVertices() //{ */
+
+template <int _N>
+bool PolynomialOptimizationSingleSegment<_N>::setupFromVertices(const Vertex& start, const Vertex& end, double segment_time, int derivative_to_optimize) {
+  CHECK_EQ(static_cast<size_t>(start.D()), dimension_);
+  CHECK_EQ(static_cast<size_t>(end.D()), dimension_);
+  CHECK(derivative_to_optimize >= 0 && derivative_to_optimize <= kHighestDerivativeToOptimize)
+      << "You tried to optimize the " << derivative_to_optimize << "th derivative of position on a " << N
+      << "th order polynomial. This is not possible, you either need a higher order polynomial or a smaller derivative to optimize.";
+
+  derivative_to_optimize_ = derivative_to_optimize;
+
+  boundary_values_.setZero(N, dimension_);
+  free_indices_.clear();
+  rest_to_rest_ = true;
+
+  // The rows follow the mapping matrix, [A(t=0); A(t=segment_time)].
+  for (int i = 0; i < N; ++i) {
+    const Vertex&   vertex     = i < N / 2 ? start : end;
+    const int       derivative = i % (N / 2);
+    Eigen::VectorXd value;
+    if (vertex.getConstraint(derivative, &value)) {
+      boundary_values_.row(i) = value.transpose();
+      rest_to_rest_ &= derivative == derivative_order::POSITION || value.isZero();
+    } else {
+      free_indices_.push_back(i);
+    }
+  }
+
+  solve(segment_time);
+  return true;
+}
+
+//}
+
+/* addMaximumMagnitudeConstraint() //{ */
+
+template <int _N>
+bool PolynomialOptimizationSingleSegment<_N>::addMaximumMagnitudeConstraint(int derivative, double maximum_value) {
+  CHECK_GT(derivative, derivative_order::POSITION);
+  CHECK_LT(derivative, N - 1);
+
+  if (maximum_value <= 0.0) {
+    LOG(ERROR) << "The maximum magnitude of derivative " << derivative << " has to be positive, got " << maximum_value;
+    return false;
+  }
+
+  maximum_magnitude_constraints_.emplace_back(derivative, maximum_value);
+  return true;
+}
+
+//}
+
+/* solve() //{ */
+
+template <int _N>
+void PolynomialOptimizationSingleSegment<_N>::solve(double segment_time) {
+  CHECK_GT(segment_time, 0) << "Segment times need to be greater than zero";
+
+  segment_time_ = segment_time;
+
+  SquareMatrix A_inv;
+  PolynomialOptimization<N>::computeSegmentMatrices(derivative_to_optimize_, segment_time, &A_inv, &cost_matrix_);
+
+  SegmentMatrix d = boundary_values_;
+
+  const int n_free = free_indices_.size();
+  if (n_free > 0) {
+    // R = A^{-T}QA^{-1} as in PolynomialOptimization, the optimal free values
+    // are d_p = -R_pp^{-1} * R_pf * d_f. As the free values in d are zero,
+    // R_pf * d_f are the free rows of R * d.
+    const SquareMatrix  R  = A_inv.transpose() * cost_matrix_ * A_inv;
+    const SegmentMatrix Rd = R * d;
+
+    Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, N, N> R_pp(n_free, n_free);
+    Eigen::MatrixXd                                                R_pf_d_f(n_free, dimension_);
+    for (int row = 0; row < n_free; ++row) {
+      for (int col = 0; col < n_free; ++col) {
+        R_pp(row, col) = R(free_indices_[row], free_indices_[col]);
+      }
+      R_pf_d_f.row(row) = Rd.row(free_indices_[row]);
+    }
+
+    const Eigen::MatrixXd d_p = -R_pp.ldlt().solve(R_pf_d_f);
+    for (int row = 0; row < n_free; ++row) {
+      d.row(free_indices_[row]) = d_p.row(row);
+    }
+  }
+
+  coefficients_ = A_inv * d;
+}
+
+//}
+
+/* optimize() //{ */
+
+template <int _N>
+bool PolynomialOptimizationSingleSegment<_N>::optimize() {
+  double scaling;
+  if (!computeTimeScaling(&scaling)) {
+    return false;
+  }
+
+  if (rest_to_rest_) {
+    solve(std::max(segment_time_ * scaling, kMinSegmentTime));
+    return true;
+  }
+
+  // The shortest segment time meeting the constraints, or the one with the
+  // smallest violation, if none does so far.
+  double best_segment_time = segment_time_;
+  double best_scaling      = scaling;
+
+  // The scaling is a function of the segment time, log(scaling) over
+  // log(segment_time) has a slope of -1 if the shape does not change. The
+  // first step assumes so, the following ones take the slope from the last
+  // two steps (secant method).
+  double slope = -1.0;
+
+  for (int i = 0; i < kMaxScalingIterations && std::abs(scaling - 1.0) >= kScalingTolerance; ++i) {
+    if (scaling < 1.0 && segment_time_ <= kMinSegmentTime) {
+      break;
+    }
+
+    const double previous_segment_time = segment_time_;
+    const double previous_scaling      = scaling;
+
+    solve(std::max(segment_time_ * std::pow(scaling, -1.0 / slope), kMinSegmentTime));
+    // A segment time, whose maxima could not be computed, is not taken.
+    if (!computeTimeScaling(&scaling)) {
+      break;
+    }
+
+    const bool feasible      = scaling < 1.0 + kScalingTolerance;
+    const bool best_feasible = best_scaling < 1.0 + kScalingTolerance;
+    if (feasible ? (!best_feasible || segment_time_ < best_segment_time) : scaling < best_scaling) {
+      best_segment_time = segment_time_;
+      best_scaling      = scaling;
+    }
+
+    slope = std::log(scaling / previous_scaling) / std::log(segment_time_ / previous_segment_time);
+
+    // Stretching the segment does not reduce the violation.
+    if (!(slope < 0.0)) {
+      break;
+    }
+  }
+
+  if (segment_time_ != best_segment_time) {
+    solve(best_segment_time);
+  }
+
+  return best_scaling < 1.0 + kScalingTolerance;
+}
+
+//}
+
+/* computeTimeScaling() //{ */
+
+template <int _N>
+bool PolynomialOptimizationSingleSegment<_N>::computeTimeScaling(double* scaling) const {
+  CHECK_NOTNULL(scaling);
+
+  Segment segment(N, dimension_);
+  getSegment(&segment);
+
+  std::vector<int> dimensions(dimension_);
+  std::iota(dimensions.begin(), dimensions.end(), 0);
+
+  double                max_scaling = 0.0;
+  std::vector<Extremum> candidates;
+  for (const std::pair<int, double>& constraint : maximum_magnitude_constraints_) {
+    const int derivative = constraint.first;
+    double    limit      = constraint.second;
+
+    const bool start_fixed = std::find(free_indices_.begin(), free_indices_.end(), derivative) == free_indices_.end();
+    const bool end_fixed   = std::find(free_indices_.begin(), free_indices_.end(), N / 2 + derivative) == free_indices_.end();
+    if (derivative <= kHighestDerivativeToOptimize && start_fixed) {
+      limit = std::max(limit, boundary_values_.row(derivative).norm());
+    }
+    if (derivative <= kHighestDerivativeToOptimize && end_fixed) {
+      limit = std::max(limit, boundary_values_.row(N / 2 + derivative).norm());
+    }
+
+    if (!segment.computeMinMaxMagnitudeCandidates(derivative, 0.0, segment_time_, dimensions, &candidates)) {
+      return false;
+    }
+
+    double maximum = 0.0;
+    for (const Extremum& candidate : candidates) {
+      maximum = std::max(maximum, candidate.value);
+    }
+
+    max_scaling = std::max(max_scaling, std::pow(maximum / limit, 1.0 / derivative));
+  }
+
+  *scaling = max_scaling > 0.0 ? max_scaling : 1.0;
+  return true;
+}
+
+//}
+
+/* computeCost() //{ */
+
+template <int _N>
+double PolynomialOptimizationSingleSegment<_N>::computeCost() const {
+  // Sum of c^T * Q * c over all dimensions (columns of the coefficients).
+  return 0.5 * (cost_matrix_ * coefficients_).cwiseProduct(coefficients_).sum();
+}
+
+//}
+
+/* getSegment() //{ */
+
+template <int _N>
+void PolynomialOptimizationSingleSegment<_N>::getSegment(Segment* segment) const {
+  CHECK_NOTNULL(segment);
+  *segment = Segment(N, dimension_);
+  segment->setTime(segment_time_);
+  for (size_t dimension_idx = 0; dimension_idx < dimension_; ++dimension_idx) {
+    (*segment)[dimension_idx] = Polynomial(N, coefficients_.col(dimension_idx));
+  }
+}
+
+//}
+
+/* getTrajectory() //{ */
+
+template <int _N>
+void PolynomialOptimizationSingleSegment<_N>::getTrajectory(Trajectory* trajectory) const {
+  CHECK_NOTNULL(trajectory);
+  Segment segment(N, dimension_);
+  getSegment(&segment);
+  trajectory->setSegments(Segment::Vector{segment});
+}
+
+//}
+
+// Instantiated in polynomial_optimization_dispatch.cpp.
+extern template class PolynomialOptimizationSingleSegment<8>;
+extern template class PolynomialOptimizationSingleSegment<10>;
+extern template class PolynomialOptimizationSingleSegment<12>;
+extern template class PolynomialOptimizationSingleSegment<14>;
+
+}  // namespace eth_trajectory_generation
+
+#endif  // ETH_TRAJECTORY_GENERATION_IMPL_POLYNOMIAL_OPTIMIZATION_SINGLE_SEGMENT_IMPL_H_
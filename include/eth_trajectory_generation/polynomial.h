@@ -42,8 +42,8 @@ public:
   // Maximum degree of a polynomial for which the static derivative (basis
   // coefficient) matrix should be evaluated for.
   // kMaxN = max. number of coefficients.
-  static constexpr int kMaxN = 12;
-  // kMaxConvolutionSize = max. convolution size for N = 12, convolved with its
+  static constexpr int kMaxN = 14;
+  // kMaxConvolutionSize = max. convolution size for N = 14, convolved with its
   // derivative.
   static constexpr int kMaxConvolutionSize = 2 * kMaxN - 2;
   // One static shared across all members of the class, computed up to order
@@ -0,0 +1,51 @@
+#ifndef ETH_TRAJECTORY_GENERATION_POLYNOMIAL_OPTIMIZATION_DISPATCH_H_
+#define ETH_TRAJECTORY_GENERATION_POLYNOMIAL_OPTIMIZATION_DISPATCH_H_
+
+#include <type_traits>
+
+#include <eth_trajectory_generation/polynomial.h>
+
+namespace eth_trajectory_generation
+{
+
+// The numbers of coefficients N of the polynomials, for which the
+// optimizations are instantiated in the library. A polynomial with N
+// coefficients can optimize and constrain derivatives up to N / 2 - 1.
+static constexpr int kSupportedN[] = {8, 10, 12, 14};
+
+static_assert(kSupportedN[sizeof(kSupportedN) / sizeof(kSupportedN[0]) - 1] <= Polynomial::kMaxN,
+              "The base coefficients have to cover all supported N.");
+
+// Returns the smallest supported N, which can optimize the derivative to
+// optimize and constrain the highest constrained derivative, -1 if there is
+// none.
+int getSmallestSupportedN(int derivative_to_optimize, int highest_constrained_derivative);
+
+bool isSupportedN(int n);
+
+// Calls function(std::integral_constant<int, N>()) with the supported N equal
+// to n, i.e. instantiates the templated function for all supported N and
+// selects one at runtime. Returns false if n is not supported.
+template <typename Function>
+bool dispatchN(int n, Function&& function) {
+  switch (n) {
+    case 8:
+      function(std::integral_constant<int, 8>());
+      return true;
+    case 10:
+      function(std::integral_constant<int, 10>());
+      return true;
+    case 12:
+      function(std::integral_constant<int, 12>());
+      return true;
+    case 14:
+      function(std::integral_constant<int, 14>());
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace eth_trajectory_generation
+
+#endif  // ETH_TRAJECTORY_GENERATION_POLYNOMIAL_OPTIMIZATION_DISPATCH_H_
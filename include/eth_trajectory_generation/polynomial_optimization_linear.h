@@ -22,7 +22,9 @@
 #define ETH_TRAJECTORY_GENERATION_POLYNOMIAL_OPTIMIZATION_LINEAR_H_
 
 #include <Eigen/Sparse>
+#include <memory>
 #include <tuple>
+#include <unordered_map>
 
 #include <eth_trajectory_generation/misc.h>
 #include <eth_trajectory_generation/extremum.h>
@@ -53,8 +55,10 @@ public:
     N = _N
   };
   static constexpr int                                                      kHighestDerivativeToOptimize = N / 2 - 1;
+  static constexpr size_t                                                   kDefaultDenseSolverThreshold = 60;
   typedef Eigen::Matrix<double, N, N>                                       SquareMatrix;
   typedef std::vector<SquareMatrix, Eigen::aligned_allocator<SquareMatrix>> SquareMatrixVector;
+  typedef Eigen::Matrix<double, N, Eigen::Dynamic>                          SegmentMatrix;  // N x dimension, e.g. coefficients.
 
   // Sets up the optimization problem for the specified dimension.
   PolynomialOptimization(size_t dimension);
@@ -87,6 +91,22 @@ public:
 
   static void setupMappingMatrix(double segment_time, SquareMatrix* A);
 
+  // Computes the inverse mapping matrix and the cost matrix of a segment by
+  // a diagonal scaling of the matrices of the unit segment (T = 1), which
+  // are computed once per N and derivative. With D = diag(1, T, ..., T^(N-1))
+  // and S = diag(1, T, ..., T^(N/2-1), 1, T, ..., T^(N/2-1)):
+  // A(T)^-1 = D^-1 * A(1)^-1 * S and Q(T) = T^(1-2r) * D * Q(1) * D,
+  // r = derivative. Avoids evaluating and inverting A(T) for every segment.
+  static void computeSegmentMatrices(int derivative, double segment_time, SquareMatrix* inverse_mapping_matrix, SquareMatrix* cost_matrix);
+
+  // Computes the cost matrix W of the corridor cost of a segment, 0.5 * c^T *
+  // W * c is the integral of the squared deviation from the straight motion
+  // between the start and the end point of the segment. The motion along the
+  // line follows the minimum jerk profile 10s^3 - 15s^4 + 6s^5 of the
+  // relative time s = t / T, so the deviation vanishes for a straight segment
+  // stopping at its ends. As the cost matrix, W(T) = T * D * W(1) * D.
+  static void computeCorridorCostMatrix(double segment_time, SquareMatrix* corridor_cost_matrix);
+
   // Computes the cost in the derivative that was specified during
   // setupFromVertices().
   // The cost is computed as: 0.5*c^T*Q*c
@@ -99,19 +119,75 @@ public:
   // to be called during non-linear optimization procedures.
   void updateSegmentTimes(const std::vector<double>& segment_times);
 
+  // Sets the weights of the corridor cost of the segments, see
+  // computeCorridorCostMatrix(), which is added to the cost of the derivative
+  // to optimize. A high weight keeps a segment close to its straight line at
+  // the price of slowing down at its ends. The weights are zero after
+  // setupFromVertices(), which leaves the problem unchanged.
+  void setCorridorWeights(const std::vector<double>& corridor_weights);
+
+  void getCorridorWeights(std::vector<double>* corridor_weights) const {
+    CHECK_NOTNULL(corridor_weights);
+    *corridor_weights = corridor_weights_;
+  }
+
+  // Updates the values of the constraints of the start vertex, e.g. to
+  // re-plan from the current state, without setting up the problem again.
+  // The vertex has to constrain the same derivatives as the start vertex
+  // passed during the problem setup, returns false otherwise. The segments
+  // are updated by the next solveLinear().
+  bool updateStartVertex(const Vertex& vertex);
+
   // Solves the linear optimization problem according to [1].
   // The solver is re-used for every dimension, which means:
   //  - segment times are equal for each dimension.
   //  - each dimension has the same type/set of constraints. Their values can of
   //    course differ.
+  // All dimensions are solved at once as multiple right-hand sides.
+  // Problems with at most getDenseSolverThreshold() free constraints are
+  // solved by a dense LDLT decomposition, larger ones by a sparse LDLT
+  // decomposition. The decomposition is kept for
+  // computeCostChangeOfSegmentTime().
   bool solveLinear();
 
+  // Computes the change of the optimal cost, if the time of a single segment
+  // was changed to segment_time, without changing the problem. The segment
+  // changes only the blocks of R of its own (at most N) constraints, so the
+  // solution is updated by the Woodbury identity on the decomposition of
+  // Rpp kept by the last solveLinear(), which takes a solve per free
+  // constraint of the segment instead of a new decomposition.
+  // Returns false if there is no valid decomposition, i.e. the segment
+  // times, the constraints or the solution changed since solveLinear().
+  bool computeCostChangeOfSegmentTime(size_t segment, double segment_time, double* cost_change) const;
+
+  // Sets the maximum number of free constraints, for which the dense solver
+  // is used. Set to 0 to always use the sparse solver.
+  void setDenseSolverThreshold(size_t threshold) {
+    dense_solver_threshold_ = threshold;
+  }
+
+  size_t getDenseSolverThreshold() const {
+    return dense_solver_threshold_;
+  }
+
+  // Sets the minimum number of segments, for which the maxima candidates are
+  // searched in parallel, see computeMaximaOfMagnitude(). Fewer segments are
+  // searched serially.
+  void setParallelSegmentThreshold(size_t threshold) {
+    parallel_segment_threshold_ = threshold;
+  }
+
+  size_t getParallelSegmentThreshold() const {
+    return parallel_segment_threshold_;
+  }
+
   // Returns the trajectory created by the optimization.
   // Only valid after solveLinear() is called. This is the preferred external
   // interface for getting information back out of the solver.
   void getTrajectory(Trajectory* trajectory) const {
     CHECK_NOTNULL(trajectory);
     trajectory->setSegments(segments_);
+    trajectory->setParallelSegmentThreshold(parallel_segment_threshold_);
   }
 
   // Computes the candidates for the maximum magnitude of a single
@@ -168,6 +244,37 @@ public:
   // Template-free version of above.
   Extremum computeMaximumOfMagnitude(int derivative, std::vector<Extremum>* candidates) const;
 
+  // Computes the global maxima of the magnitude of several derivatives in a
+  // single sweep over the segments. The derivative coefficients of each
+  // segment are computed once and shared between the derivatives, as are the
+  // buffers for the candidate search. The candidates of each segment are
+  // cached by its coefficients and time, so only changed segments are
+  // searched again, in parallel if there are at least
+  // getParallelSegmentThreshold() of them.
+  // Input: derivatives = Derivatives in which to find the maxima, each at
+  // most kMaxMagnitudeDerivative.
+  // Output: maxima = The global maxima, indexed by the derivative.
+  // Output: candidates = All candidates of the maxima, indexed by the
+  // derivative. Optional, can be set to nullptr if not needed.
+  void computeMaximaOfMagnitude(const std::vector<int>& derivatives, MagnitudeMaxima* maxima, MagnitudeCandidates* candidates) const;
+
+  // Statistics of the cache of the maxima candidates of the segments, see
+  // computeMaximaOfMagnitude(). Each hit saves the root finding of one
+  // segment in one derivative.
+  struct ExtremaCacheStatistics
+  {
+    size_t hits   = 0;
+    size_t misses = 0;
+  };
+
+  ExtremaCacheStatistics getExtremaCacheStatistics() const {
+    return extrema_cache_statistics_;
+  }
+
+  void resetExtremaCacheStatistics() {
+    extrema_cache_statistics_ = ExtremaCacheStatistics();
+  }
+
   void getVertices(Vertex::Vector* vertices) const {
     CHECK_NOTNULL(vertices);
     *vertices = vertices_;
@@ -184,18 +291,45 @@ public:
     *segment_times = segment_times_;
   }
 
-  void getFreeConstraints(std::vector<Eigen::VectorXd>* free_constraints) const {
+  // The compact constraints are stored as (number of constraints x
+  // dimension) matrices, such that all dimensions are solved at once.
+  void getFreeConstraints(Eigen::MatrixXd* free_constraints) const {
     CHECK(free_constraints != nullptr);
     *free_constraints = free_constraints_compact_;
   }
 
+  void getFreeConstraints(std::vector<Eigen::VectorXd>* free_constraints) const;
+
+  void setFreeConstraints(const Eigen::MatrixXd& free_constraints);
+
   void setFreeConstraints(const std::vector<Eigen::VectorXd>& free_constraints);
 
-  void getFixedConstraints(std::vector<Eigen::VectorXd>* fixed_constraints) const {
+  void getFixedConstraints(Eigen::MatrixXd* fixed_constraints) const {
     CHECK(fixed_constraints != nullptr);
     *fixed_constraints = fixed_constraints_compact_;
   }
 
+  void getFixedConstraints(std::vector<Eigen::VectorXd>* fixed_constraints) const;
+
+  // Computes the gradient of computeCost() w.r.t. the free constraints
+  // (number of free constraints x dimension) and w.r.t. the segment times,
+  // while all constraints are held constant.
+  void computeCostGradients(Eigen::MatrixXd* gradient_free_constraints, std::vector<double>* gradient_segment_times) const;
+
+  // Computes the gradient of the magnitude of the given derivative at the
+  // given extremum w.r.t. the free constraints and the segment times. The
+  // time of the extremum within its segment is held constant, which is exact
+  // for a unique maximum (the magnitude is stationary there).
+  void computeMagnitudeGradients(int derivative, const Extremum& extremum, Eigen::MatrixXd* gradient_free_constraints,
+                                 std::vector<double>* gradient_segment_times) const;
+
+  // Computes the maximum distance of each segment from the straight line
+  // between its start and end point, in the first n_dimensions dimensions
+  // (e.g. only the position, if the heading is solved together with it). The
+  // segments are searched in parallel from getParallelSegmentThreshold().
+  // Output: maxima = The maximum of each segment, indexed by the segment.
+  void computeMaximaOfDeviation(size_t n_dimensions, std::vector<Extremum>* maxima) const;
+
   // Computes the Jacobian of the integral over the squared derivative
   // Output: cost_jacobian = Jacobian matrix to write into.
   // If C is dynamic, the correct size has to be set.
@@ -246,6 +380,48 @@ private:
   // and free constraints.
   void updateSegmentsFromCompactConstraints();
 
+  // Propagates a gradient w.r.t. the coefficients of a segment (N x
+  // dimension) to the reordered constraints of that segment, which is
+  // returned. The part caused by the change of the mapping matrix with the
+  // segment time is added to gradient_segment_time.
+  SegmentMatrix backpropagateCoefficientGradient(size_t segment, const SegmentMatrix& gradient_coefficients, double* gradient_segment_time) const;
+
+  // Computes the coefficients (N x n_dimensions) of the deviation of the
+  // segment from the straight line between its start and end point, i.e. of
+  // its position relative to the start, projected onto the normal plane.
+  void computeDeviationFromLine(size_t segment, size_t n_dimensions, SegmentMatrix* deviation) const;
+
+  // computeSegmentMatrices() with the weighted corridor cost of the segment
+  // added to the cost matrix.
+  void computeWeightedSegmentMatrices(size_t segment, double segment_time, SquareMatrix* inverse_mapping_matrix, SquareMatrix* cost_matrix) const;
+
+  // Candidates of the maxima of the magnitude of a segment, which are
+  // reused as long as the coefficients and the time of a segment stay the
+  // same. The coefficients are kept to tell hash collisions apart.
+  struct ExtremaCacheEntry
+  {
+    SegmentMatrix       coefficients;
+    double              segment_time = 0.0;
+    MagnitudeCandidates candidates;  // Empty if not computed yet.
+  };
+
+  // Scratch of the search for the maxima candidates, one per thread.
+  struct ExtremaScratch
+  {
+    Eigen::MatrixXd              derivative_coefficients;
+    std::vector<Eigen::VectorXd> convolved;
+    Eigen::VectorXcd             roots;
+    std::vector<double>          extrema_times;
+  };
+
+  // Hashes the coefficients (N x dimension) and the time of a segment.
+  static size_t hashSegment(const SegmentMatrix& coefficients, double segment_time);
+
+  // Searches the maxima candidates of the segment of a cache entry in all
+  // given derivatives, which have no candidates yet.
+  static void computeSegmentMaximaCandidates(const std::vector<int>& derivatives, int highest_derivative, ExtremaCacheEntry* entry,
+                                             ExtremaScratch* scratch);
+
   // Matrix consisting of entries with value 1 to reorder free and fixed
   // constraints (C in [1]).
   Eigen::SparseMatrix<double> constraint_reordering_;
@@ -263,16 +439,19 @@ private:
   // Vector that stores the cost matrix for each segment (Q in [1]).
   SquareMatrixVector cost_matrices_;
 
-  // Contains the compact form of fixed constraints for each dimension
-  // (d_f in [1]).
-  std::vector<Eigen::VectorXd> fixed_constraints_compact_;
+  // Contains the compact form of fixed constraints, one column for each
+  // dimension (d_f in [1]).
+  Eigen::MatrixXd fixed_constraints_compact_;
 
-  // Contains the compact form of free constraints to optimize for each
-  // dimension (d_p in [1]).
-  std::vector<Eigen::VectorXd> free_constraints_compact_;
+  // Contains the compact form of free constraints to optimize, one column for
+  // each dimension (d_p in [1]).
+  Eigen::MatrixXd free_constraints_compact_;
 
   std::vector<double> segment_times_;
 
+  // Weights of the corridor cost, one per segment.
+  std::vector<double> corridor_weights_;
+
   // Number of polynomials, e.g 3 for a 3D path.
   size_t dimension_;
 
@@ -283,31 +462,33 @@ private:
   size_t n_all_constraints_;
   size_t n_fixed_constraints_;
   size_t n_free_constraints_;
-};
 
-// Constraint class that aggregates all constraints from incoming Vertices.
-struct Constraint
-{
-  inline bool operator<(const Constraint& rhs) const {
-    if (vertex_idx < rhs.vertex_idx)
-      return true;
-    if (rhs.vertex_idx < vertex_idx)
-      return false;
-
-    if (constraint_idx < rhs.constraint_idx)
-      return true;
-    if (rhs.constraint_idx < constraint_idx)
-      return false;
-    return false;
-  }
+  // Maximum number of free constraints solved by the dense solver.
+  size_t dense_solver_threshold_;
 
-  inline bool operator==(const Constraint& rhs) const {
-    return vertex_idx == rhs.vertex_idx && constraint_idx == rhs.constraint_idx;
-  }
+  // Compact column of every (vertex, derivative) pair at
+  // vertex * N / 2 + derivative. The constraint l of segment i is at
+  // i * N / 2 + l, as the segments share their boundary vertices.
+  std::vector<int> compact_columns_;
+
+  // The free constraints are ordered by vertex, Rpp is banded and its
+  // sparse Cholesky factor keeps the band without any fill-reducing ordering.
+  typedef Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>, Eigen::Lower, Eigen::NaturalOrdering<int>> SparseSolver;
+
+  // Decomposition of Rpp of the last solveLinear() (the sparse one is not
+  // copyable), valid until the segment times or the constraints change.
+  Eigen::LDLT<Eigen::MatrixXd>        rpp_dense_solver_;
+  std::shared_ptr<const SparseSolver> rpp_sparse_solver_;
+  bool                                rpp_decomposition_valid_;
+
+  // Minimum number of segments searched for maxima in parallel.
+  size_t parallel_segment_threshold_;
+
+  // Maximum number of cached segments, the cache is cleared when full.
+  static constexpr size_t kExtremaCacheMaxSize = 1024;
 
-  size_t                  vertex_idx;
-  size_t                  constraint_idx;
-  Vertex::ConstraintValue value;
+  mutable std::unordered_map<size_t, ExtremaCacheEntry> extrema_cache_;
+  mutable ExtremaCacheStatistics                        extrema_cache_statistics_;
 };
 
 }  // namespace eth_trajectory_generation
@@ -31,6 +31,9 @@ namespace eth_trajectory_generation
 
 constexpr double kOptimizationTimeLowerBound = 0.01;
 
+// Maximum number of raises of the corridor weights in an optimization.
+constexpr int kMaxCorridorIterations = 10;
+
 // Class holding all important parameters for nonlinear optimization.
 struct NonlinearOptimizationParameters
 {
@@ -66,6 +69,10 @@ struct NonlinearOptimizationParameters
   // Maximum number of iterations. Disabled if negative.
   int max_iterations = 3000;
 
+  // Maximum wall-clock time of the optimization in seconds, the best
+  // solution found until then is kept. Disabled if not positive.
+  double max_time = -1;
+
   // Penalty for the segment time.
   double time_penalty = 500.0;
 
@@ -87,14 +94,29 @@ struct NonlinearOptimizationParameters
   // Weights the relative violation of a soft constraint.
   double soft_constraint_weight = 100.0;
 
+  // Maximum number of free constraints, for which the linear problem is
+  // solved by a dense instead of a sparse solver.
+  int dense_solver_threshold = PolynomialOptimization<>::kDefaultDenseSolverThreshold;
+
+  // Minimum number of segments, for which the maxima of the constraints are
+  // computed in parallel.
+  int parallel_segment_threshold = ThreadPool::kDefaultParallelSegmentThreshold;
+
+  // The numerical gradient of kMellingerOuterLoop updates the decomposition
+  // of the linear problem for the perturbed segment, instead of solving the
+  // problem again for every segment.
+  bool use_segment_time_updates = true;
+
   enum TimeAllocMethod
   {
-    kSquaredTime               = 0,
-    kRichterTime               = 1,
-    kMellingerOuterLoop        = 2,
-    kSquaredTimeAndConstraints = 3,
-    kRichterTimeAndConstraints = 4,
-    kUnknown                   = 5,
+    kSquaredTime                = 0,
+    kRichterTime                = 1,
+    kMellingerOuterLoop         = 2,
+    kSquaredTimeAndConstraints  = 3,
+    kRichterTimeAndConstraints  = 4,
+    kMellingerProjectedGradient = 5,
+    kTimeScalingOnly            = 6,
+    kUnknown                    = 7,
   } time_alloc_method = kSquaredTimeAndConstraints;
 
   bool print_debug_info                 = false;
@@ -109,7 +131,15 @@ struct OptimizationInfo
   double                  cost_time             = 0.0;
   double                  cost_soft_constraints = 0.0;
   double                  optimization_time     = 0.0;
-  std::map<int, Extremum> maxima;
+  size_t                  extrema_cache_hits    = 0;
+  size_t                  extrema_cache_misses  = 0;
+  MagnitudeMaxima         maxima;
+
+  // The optimization stopped by its own criteria, not at the maximum number
+  // of iterations or the maximum time.
+  bool converged() const {
+    return (stopping_reason >= nlopt::SUCCESS && stopping_reason < nlopt::MAXEVAL_REACHED) || stopping_reason == nlopt::ROUNDOFF_LIMITED;
+  }
 };
 
 std::ostream& operator<<(std::ostream& stream, const OptimizationInfo& val);
@@ -161,6 +191,21 @@ public:
   // maximum_value = Maximum magnitude of the specified derivative.
   bool addMaximumMagnitudeConstraint(int derivative_order, double maximum_value);
 
+  // Adds a corridor around the straight line of each segment to the
+  // optimization problem. Once the segment times are optimized, the weights
+  // of the corridor cost of the segments deviating more than
+  // maximum_deviation from their line are raised until they are within it,
+  // see PolynomialOptimization::setCorridorWeights(). The scaling to the
+  // maximum magnitude constraints follows. Not applied when optimizing the
+  // free constraints.
+  // Input: maximum_deviation = Maximum distance of the position from the
+  // straight line of a segment.
+  // Input: first_segment = Whether the first segment is kept in the
+  // corridor as well.
+  // The corridor cost applies to all dimensions, so it is refused (returns
+  // false) for problems of more than 3 dimensions, e.g. with the heading.
+  bool addCorridorConstraint(double maximum_deviation, bool first_segment = true);
+
   // Solves the linear optimization problem according to [1].
   // The solver is re-used for every dimension, which means:
   //  - segment times are equal for each dimension.
@@ -172,6 +217,23 @@ public:
   // NonlinearOptimizationParameters and the constraints are met.
   int optimize();
 
+  // Prepares re-planning the remaining trajectory from a new start state,
+  // e.g. periodically while it is being flown. The first
+  // n_consumed_segments segments, whose end vertices were passed, are
+  // removed and the start vertex is replaced by the given one. The first
+  // remaining segment gets first_segment_time, the others keep their
+  // optimized times, so the next optimize() starts from the previous
+  // solution, before its scaling to the constraints, if any. The maximum
+  // magnitude constraints are kept. If no segment is
+  // consumed and the start vertex constrains the same derivatives, only the
+  // values of its constraints are updated instead of setting up the problem
+  // again.
+  bool updateStartVertex(const Vertex& start, size_t n_consumed_segments, double first_segment_time);
+
+  // Sets NonlinearOptimizationParameters::max_time for the following
+  // optimizations, e.g. a per-cycle budget when re-planning.
+  void setMaxTime(double max_time);
+
   // Get the resulting trajectory out -- prefer this as the main method
   // to get the results of the optimization, over getting the reference
   // to the linear optimizer.
@@ -195,6 +257,18 @@ public:
     return optimization_info_;
   }
 
+  // Gets the segment times before their last scaling to the maximum
+  // magnitude constraints, e.g. to seed another optimization, which scales
+  // them itself. The segment times, if they were not scaled.
+  void getUnscaledSegmentTimes(std::vector<double>* segment_times) const {
+    CHECK_NOTNULL(segment_times);
+    if (unscaled_segment_times_.empty()) {
+      poly_opt_.getSegmentTimes(segment_times);
+    } else {
+      *segment_times = unscaled_segment_times_;
+    }
+  }
+
   // Functions for optimization, but may be useful for diagnostics outside.
   // Gets the trajectory cost (same as the cost in the linear problem).
   double getCost() const;
@@ -241,25 +315,52 @@ private:
   // The variables (time, derivatives) are stacked as follows: [segment_times
   // derivatives_dim_0 ... derivatives_dim_N]
   // Input: gradient = Gradient of the objective function wrt. changes of
-  // parameters. We can't compute the gradient analytically here.
-  // Thus, only gradient free optimization methods are possible.
+  // parameters. Computed analytically if requested, the gradient of the soft
+  // constraints is approximated at the current maxima. Thus, gradient-based
+  // methods (e.g. nlopt::LD_LBFGS) can be used as well.
   // Input: data = Custom data pointer. In our case, it's an ConstraintData
   // object.
   // Output: Cost based on the parameters passed in.
   static double objectiveFunctionTimeAndConstraints(const std::vector<double>& optimization_variables, std::vector<double>& gradient, void* data);
 
-  // Evaluates the maximum magnitude constraint at the current value of
-  // the optimization variables.
-  // All input parameters are ignored, all information is contained in data.
+  // Evaluates the maximum magnitude constraint at the given optimization
+  // variables, which are applied by setOptimizationVariables(), i.e. the
+  // problem is only re-solved if they differ from the last evaluated ones.
+  // Empty optimization_variables keep the current state.
+  // Input: data = ConstraintData object, the derivative and its limit.
+  // The gradient can only be computed when optimizing the free constraints.
   static double evaluateMaximumMagnitudeConstraint(const std::vector<double>& optimization_variables, std::vector<double>& gradient, void* data);
 
   // Does the actual optimization work for the time-only version.
   int optimizeTime();
   int optimizeTimeMellingerOuterLoop();
 
+  // Same problem as optimizeTimeMellingerOuterLoop(), solved without nlopt
+  // by a spectral projected gradient method on the segment times. The
+  // iterates keep the total time and the lower bound of the segment times,
+  // the gradient w.r.t. the segment times is analytic.
+  int optimizeTimeMellingerProjectedGradient();
+
+  // Solves the linear problem once on the initial segment times and only
+  // stretches the segments violating the constraints, without any nonlinear
+  // optimization. The run time is bounded by two linear solves and one search
+  // of the maxima per segment.
+  int optimizeTimeScalingOnly();
+
   // Does the actual optimization work for the full optimization version.
   int optimizeTimeAndFreeConstraints();
 
+  // Raises the corridor weights of the segments outside of the corridor and
+  // solves the linear problem again, until all are within it or
+  // kMaxCorridorIterations is reached. Does nothing without a corridor.
+  // Returns true if the weights were raised.
+  bool fitCorridor();
+
+  // Fits the corridor and scales the segment times to the constraints. The
+  // scaling changes the shape of the stretched segments, both are repeated
+  // once if it moves a segment out of the corridor.
+  void fitCorridorAndScaleSegmentTimes();
+
   // Evaluates the maximum magnitude constraints as soft constraints and
   // returns a cost, depending on the violation of the constraints.
   // cost_i = min(maximum_cost, exp(abs_violation_i / max_allowed_i * weight))
@@ -273,15 +374,43 @@ private:
   double evaluateMaximumMagnitudeAsSoftConstraint(const std::vector<std::shared_ptr<ConstraintData>>& inequality_constraints, double weight,
                                                   double maximum_cost = 1.0e12) const;
 
+  // Adds the gradient of the soft constraint cost above w.r.t. the free
+  // constraints and the segment times to the given gradients. The maximum
+  // over the segments is approximated by a soft maximum for the gradient.
+  void addMaximumMagnitudeSoftConstraintGradients(double weight, Eigen::MatrixXd* gradient_free_constraints, std::vector<double>* gradient_segment_times,
+                                                  double maximum_cost = 1.0e12) const;
+
   // Set lower and upper bounds on the optimization parameters
   void setFreeEndpointDerivativeHardConstraints(const Vertex::Vector& vertices, std::vector<double>* lower_bounds, std::vector<double>* upper_bounds);
 
   // Computes the gradients by doing forward difference!
   double getCostAndGradientMellinger(std::vector<double>* gradients);
 
+  // Applies the segment times and returns the cost of the trajectory.
+  double evaluateSegmentTimes(const Eigen::VectorXd& segment_times);
+
+  // Projects the segment times onto the segment times with the given total
+  // time, which are all at least kOptimizationTimeLowerBound.
+  static void projectSegmentTimes(double total_time, Eigen::VectorXd* segment_times);
+
   // Computes the total trajectory time.
   static double computeTotalTrajectoryTime(const std::vector<double>& segment_times);
 
+  // Applies the optimization variables of the current time allocation method
+  // to the underlying linear problem, unless they are the same as in the last
+  // evaluation. Returns true if the problem was updated.
+  bool setOptimizationVariables(const std::vector<double>& optimization_variables);
+
+  // Returns the maximum of magnitude of the derivative for the current
+  // optimization variables. The maxima of all constrained derivatives are
+  // computed together, once per evaluation.
+  // Output: candidates = All candidates of the maximum, optional.
+  Extremum getMaximumOfMagnitude(int derivative, std::vector<Extremum>* candidates = nullptr) const;
+
+  // Invalidates the cached evaluation, has to be called whenever the linear
+  // problem is changed from outside setOptimizationVariables().
+  void invalidateEvaluationCache();
+
   // nlopt optimization object.
   std::shared_ptr<nlopt::opt> nlopt_;
 
@@ -295,6 +424,31 @@ private:
   std::vector<std::shared_ptr<ConstraintData>> inequality_constraints_;
 
   OptimizationInfo optimization_info_;
+
+  // Segment times before the last scaleSegmentTimesWithViolation(), which
+  // only stretches segments. Re-planning starts from them, starting from the
+  // scaled ones would stretch the trajectory further in every cycle.
+  std::vector<double> unscaled_segment_times_;
+
+  // The corridor, see addCorridorConstraint(), not set if not positive.
+  double corridor_maximum_deviation_ = 0.0;
+  bool   corridor_first_segment_     = true;
+  // Last step length of the projected gradient, the next optimization of the
+  // same problem starts with it. Not positive after the setup.
+  double projected_gradient_step_ = 0.0;
+
+  // Evaluation at the last optimization variables, shared by the objective
+  // and the constraint callbacks. Only valid during optimize().
+  struct EvaluationCache
+  {
+    bool                valid        = false;
+    bool                maxima_valid = false;
+    std::vector<double> optimization_variables;
+    MagnitudeMaxima     maxima;
+    MagnitudeCandidates candidates;
+  };
+
+  mutable EvaluationCache evaluation_cache_;
 };
 
 }  // namespace eth_trajectory_generation
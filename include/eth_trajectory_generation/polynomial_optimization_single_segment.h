@@ -0,0 +1,116 @@
+#ifndef ETH_TRAJECTORY_GENERATION_POLYNOMIAL_OPTIMIZATION_SINGLE_SEGMENT_H_
+#define ETH_TRAJECTORY_GENERATION_POLYNOMIAL_OPTIMIZATION_SINGLE_SEGMENT_H_
+
+#include <utility>
+#include <vector>
+
+#include <eth_trajectory_generation/misc.h>
+#include <eth_trajectory_generation/polynomial_optimization_linear.h>
+#include <eth_trajectory_generation/segment.h>
+#include <eth_trajectory_generation/trajectory.h>
+#include <eth_trajectory_generation/vertex.h>
+
+namespace eth_trajectory_generation
+{
+
+// Solves the boundary-value problem of a single polynomial segment between
+// two vertices, i.e. the problem of PolynomialOptimization with one segment,
+// in closed form on fixed-size matrices. The boundary derivatives without a
+// constraint are free and minimize the cost of the derivative to optimize.
+// Instead of a nonlinear time allocation, the segment time is scaled until
+// the maximum magnitude constraints are met.
+// _N = Number of coefficients of the underlying polynomial.
+template <int _N = 10>
+class PolynomialOptimizationSingleSegment {
+  static_assert(_N % 2 == 0, "The number of coefficients has to be even.");
+
+public:
+  enum
+  {
+    N = _N
+  };
+  static constexpr int                             kHighestDerivativeToOptimize = N / 2 - 1;
+  typedef Eigen::Matrix<double, N, N>              SquareMatrix;
+  typedef Eigen::Matrix<double, N, Eigen::Dynamic> SegmentMatrix;  // N x dimension, e.g. coefficients.
+
+  // Maximum number of re-solves of the segment while scaling its time.
+  static constexpr int kMaxScalingIterations = 10;
+  // The scaling is converged, once it changes the segment time by less than
+  // this fraction.
+  static constexpr double kScalingTolerance = 1.0e-2;
+  // The scaling does not shorten the segment below this time.
+  static constexpr double kMinSegmentTime = 0.01;
+
+  explicit PolynomialOptimizationSingleSegment(size_t dimension);
+
+  // Sets up the boundary values from the start and the end vertex and solves
+  // the segment for the initial segment time. Constraints of derivatives
+  // above kHighestDerivativeToOptimize are ignored.
+  // Input: derivative_to_optimize = Optimize the squared norm of this
+  // derivative (e.g. snap = 4 for quadrotors).
+  bool setupFromVertices(const Vertex& start, const Vertex& end, double segment_time, int derivative_to_optimize);
+
+  // Adds a constraint on the maximum magnitude of the derivative over all
+  // dimensions, met by optimize().
+  bool addMaximumMagnitudeConstraint(int derivative, double maximum_value);
+
+  // Solves the segment for the given segment time.
+  void solve(double segment_time);
+
+  // Scales the segment time until the maximum magnitudes of the segment meet
+  // their constraints exactly. Stretching a segment by s scales the k-th
+  // derivative by 1/s^k, so a segment starting and ending at rest keeps its
+  // shape and is scaled in one step. Boundary derivatives change the shape
+  // with the segment time, the scaling is then repeated on the re-solved
+  // segment. Returns false if the constraints could not be met, e.g. as the
+  // start velocity leads away from the end, the segment then is solved for
+  // the time with the smallest violation found. A segment time, whose maxima
+  // could not be computed, counts as infeasible.
+  bool optimize();
+
+  // Computes the maxima of the constrained derivatives and the factor the
+  // segment time has to be stretched by to meet the constraints, 1 if the
+  // segment has no constraints or does not move. A constraint below the
+  // magnitude of a fixed boundary value, which no segment time can reduce,
+  // is raised to it. Returns false if the search for the maxima failed.
+  bool computeTimeScaling(double* scaling) const;
+
+  double computeCost() const;
+
+  double getSegmentTime() const {
+    return segment_time_;
+  }
+
+  void getSegment(Segment* segment) const;
+
+  void getTrajectory(Trajectory* trajectory) const;
+
+  void getCoefficients(SegmentMatrix* coefficients) const {
+    CHECK_NOTNULL(coefficients);
+    *coefficients = coefficients_;
+  }
+
+private:
+  size_t dimension_;
+  int    derivative_to_optimize_;
+  double segment_time_;
+
+  // [derivatives at t = 0; derivatives at t = segment_time], N x dimension.
+  // The free boundary values are zero.
+  SegmentMatrix    boundary_values_;
+  std::vector<int> free_indices_;
+  // All fixed derivatives of position are zero.
+  bool rest_to_rest_;
+
+  SquareMatrix  cost_matrix_;
+  SegmentMatrix coefficients_;
+
+  // (derivative, maximum magnitude).
+  std::vector<std::pair<int, double>> maximum_magnitude_constraints_;
+};
+
+}  // namespace eth_trajectory_generation
+
+#include "eth_trajectory_generation/impl/polynomial_optimization_single_segment_impl.h"
+
+#endif  // ETH_TRAJECTORY_GENERATION_POLYNOMIAL_OPTIMIZATION_SINGLE_SEGMENT_H_
@@ -0,0 +1,69 @@
+#ifndef ETH_TRAJECTORY_GENERATION_THREAD_POOL_H_
+#define ETH_TRAJECTORY_GENERATION_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace eth_trajectory_generation
+{
+
+// Pool of worker threads for parallel loops over independent segments. The
+// thread calling parallelFor() takes part in the loop, so a pool of n threads
+// runs n - 1 workers.
+class ThreadPool {
+public:
+  // Loops over fewer segments than this run serially by default.
+  static constexpr size_t kDefaultParallelSegmentThreshold = 16;
+
+  explicit ThreadPool(size_t n_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Pool shared by the whole library, one thread per hardware thread.
+  static ThreadPool& getGlobalPool();
+
+  size_t getNumberOfThreads() const {
+    return workers_.size() + 1;
+  }
+
+  // Calls function(i, thread_idx) for all i in [0, n) and returns after all
+  // calls finished. The indices are handed out one by one, thread_idx in
+  // [0, getNumberOfThreads()) identifies the calling thread for per-thread
+  // scratch. Loops smaller than serial_threshold, nested loops and loops
+  // started while another one is running are run serially by the calling
+  // thread, with thread_idx 0.
+  void parallelFor(size_t n, size_t serial_threshold, const std::function<void(size_t, size_t)>& function);
+
+private:
+  void workerLoop(size_t thread_idx);
+
+  // Processes indices of the current loop until none are left.
+  void runLoop(size_t thread_idx);
+
+  std::vector<std::thread> workers_;
+
+  // Serializes the loops running on the pool.
+  std::mutex loop_mutex_;
+
+  // Protects the loop state below.
+  std::mutex              mutex_;
+  std::condition_variable condition_start_;
+  std::condition_variable condition_done_;
+  bool                    stop_           = false;
+  size_t                  generation_     = 0;
+  size_t                  active_workers_ = 0;
+
+  const std::function<void(size_t, size_t)>* function_ = nullptr;
+  size_t                                     n_        = 0;
+  std::atomic<size_t>                        next_index_{0};
+};
+
+}  // namespace eth_trajectory_generation
+
+#endif  // ETH_TRAJECTORY_GENERATION_THREAD_POOL_H_
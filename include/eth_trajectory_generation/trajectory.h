@@ -23,6 +23,7 @@
 
 #include <eth_trajectory_generation/extremum.h>
 #include <eth_trajectory_generation/segment.h>
+#include <eth_trajectory_generation/thread_pool.h>
 #include <eth_trajectory_generation/vertex.h>
 
 namespace eth_trajectory_generation
@@ -32,7 +33,7 @@ namespace eth_trajectory_generation
 // polynomial order N-1. (N=12 -> 11th order polynomial, with 12 coefficients).
 class Trajectory {
 public:
-  Trajectory() : D_(0), N_(0), max_time_(0.0) {
+  Trajectory() : D_(0), N_(0), max_time_(0.0), parallel_segment_threshold_(ThreadPool::kDefaultParallelSegmentThreshold) {
   }
   ~Trajectory() {
   }
@@ -140,8 +141,18 @@ public:
   // Compute the analytic minimum and maximum of magnitude for a given
   // derivative and dimensions, e.g., [0, 1, 2] for position or [3] for yaw.
   // Returns false in case of extremum calculation failure.
+  // The segments are processed in parallel if there are at least
+  // getParallelSegmentThreshold() of them.
   bool computeMinMaxMagnitude(int derivative, const std::vector<int>& dimensions, Extremum* minimum, Extremum* maximum) const;
 
+  void setParallelSegmentThreshold(size_t threshold) {
+    parallel_segment_threshold_ = threshold;
+  }
+
+  size_t getParallelSegmentThreshold() const {
+    return parallel_segment_threshold_;
+  }
+
   // Compute max velocity and max acceleration. Shorthand for the method above.
   bool computeMaxVelocityAndAcceleration(double* v_max, double* a_max, int seg) const;
 
@@ -152,14 +163,22 @@ public:
 
   // This method SCALES the segment times evenly to ensure that the trajectory
   // is feasible given the provided v_max and a_max. Does not change the shape
-  // of the trajectory, and only *increases* segment times.
+  // of the trajectory, and only *increases* segment times. Returns false if
+  // the extrema of a segment could not be computed, the segment then stays
+  // unscaled.
   bool scaleSegmentTimesToMeetConstraints(double v_max, double a_max);
 
 private:
+  // Stretches a single segment in time by the given factor, keeps max_time_.
+  void scaleSegmentTime(size_t seg, double scaling);
+
   int    D_;         // Number of dimensions.
   int    N_;         // Number of coefficients.
   double max_time_;  // Time at the end of the trajectory.
 
+  // Minimum number of segments processed in parallel.
+  size_t parallel_segment_threshold_;
+
   // K is number of segments...
   Segment::Vector segments_;
 };
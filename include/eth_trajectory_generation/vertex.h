@@ -119,10 +119,19 @@ std::ostream& operator<<(std::ostream& stream, const Vertex& v);
 
 std::ostream& operator<<(std::ostream& stream, const std::vector<Vertex>& vertices);
 
+// The methods of the initial segment time estimate.
+enum SegmentTimeEstimator
+{
+  kSegmentTimesEuclidean    = 0,
+  kSegmentTimesVelocityRamp = 1,
+  kSegmentTimesBaca         = 2,
+};
+
 // Makes a rough estimate based on v_max and a_max about the time
-// required to get from one vertex to the next. Uses the current preferred
-// method.
-std::vector<double> estimateSegmentTimes(const Vertex::Vector& vertices, double v_max, double a_max, double j_max);
+// required to get from one vertex to the next. Uses the given method,
+// Euclidean by default.
+std::vector<double> estimateSegmentTimes(const Vertex::Vector& vertices, double v_max, double a_max, double j_max,
+                                         SegmentTimeEstimator estimator = kSegmentTimesEuclidean);
 
 // Calculate the velocity assuming instantaneous constant acceleration a_max
 // and straight line rest-to-rest trajectories.
@@ -137,6 +146,15 @@ std::vector<double> estimateSegmentTimesBaca(const Vertex::Vector& vertices, dou
 
 double computeTimeVelocityRamp(const Eigen::VectorXd& start, const Eigen::VectorXd& goal, double v_max, double a_max);
 
+// Distributes the segment times of a coarse path, whose vertices are a subset
+// of the given ones (e.g. a decimated path), over the segments of the full
+// path. The time of a coarse segment is split proportionally to the length
+// of the full segments along it, i.e. interpolated along the arc length.
+// Input: coarse_indices = Indices of the vertices of the coarse path in
+// vertices, increasing from the first to the last vertex.
+std::vector<double> interpolateSegmentTimes(const Vertex::Vector& vertices, const std::vector<size_t>& coarse_indices,
+                                            const std::vector<double>& coarse_segment_times);
+
 inline int getHighestDerivativeFromN(int N) {
   return N / 2 - 1;
 }
@@ -0,0 +1,53 @@
+#include <eth_trajectory_generation/polynomial_optimization_dispatch.h>
+#include <eth_trajectory_generation/polynomial_optimization_linear.h>
+#include <eth_trajectory_generation/polynomial_optimization_nonlinear.h>
+#include <eth_trajectory_generation/polynomial_optimization_single_segment.h>
+
+namespace eth_trajectory_generation
+{
+
+// The optimizations are compiled once here, the headers declare these
+// instantiations extern.
+template class PolynomialOptimization<8>;
+template class PolynomialOptimization<10>;
+template class PolynomialOptimization<12>;
+template class PolynomialOptimization<14>;
+
+template class PolynomialOptimizationNonLinear<8>;
+template class PolynomialOptimizationNonLinear<10>;
+template class PolynomialOptimizationNonLinear<12>;
+template class PolynomialOptimizationNonLinear<14>;
+
+template class PolynomialOptimizationSingleSegment<8>;
+template class PolynomialOptimizationSingleSegment<10>;
+template class PolynomialOptimizationSingleSegment<12>;
+template class PolynomialOptimizationSingleSegment<14>;
+
+/* getSmallestSupportedN() //{ */
+
+int getSmallestSupportedN(const int derivative_to_optimize, const int highest_constrained_derivative) {
+  for (const int n : kSupportedN) {
+    const int highest_derivative = n / 2 - 1;
+    if (derivative_to_optimize <= highest_derivative && highest_constrained_derivative <= highest_derivative) {
+      return n;
+    }
+  }
+  return -1;
+}
+
+//}
+
+/* isSupportedN() //{ */
+
+bool isSupportedN(const int n) {
+  for (const int supported_n : kSupportedN) {
+    if (n == supported_n) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//}
+
+}  // namespace eth_trajectory_generation
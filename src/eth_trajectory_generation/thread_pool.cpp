@@ -0,0 +1,115 @@
+#include "eth_trajectory_generation/thread_pool.h"
+
+#include <algorithm>
+
+namespace eth_trajectory_generation
+{
+
+namespace
+{
+// Set while the thread executes a loop body, nested loops then run serially.
+thread_local bool in_parallel_loop = false;
+}  // namespace
+
+/* ThreadPool() //{ */
+
+ThreadPool::ThreadPool(size_t n_threads) {
+  for (size_t thread_idx = 1; thread_idx < n_threads; ++thread_idx) {
+    workers_.emplace_back(&ThreadPool::workerLoop, this, thread_idx);
+  }
+}
+
+//}
+
+/* ~ThreadPool() //{ */
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  condition_start_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+//}
+
+/* getGlobalPool() //{ */
+
+ThreadPool& ThreadPool::getGlobalPool() {
+  static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+  return pool;
+}
+
+//}
+
+/* parallelFor() //{ */
+
+void ThreadPool::parallelFor(size_t n, size_t serial_threshold, const std::function<void(size_t, size_t)>& function) {
+  std::unique_lock<std::mutex> loop_lock(loop_mutex_, std::defer_lock);
+  if (workers_.empty() || n < 2 || n < serial_threshold || in_parallel_loop || !loop_lock.try_lock()) {
+    for (size_t i = 0; i < n; ++i) {
+      function(i, 0);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    function_ = &function;
+    n_        = n;
+    next_index_.store(0);
+    active_workers_ = workers_.size();
+    ++generation_;
+  }
+  condition_start_.notify_all();
+
+  runLoop(0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  condition_done_.wait(lock, [this] { return active_workers_ == 0; });
+  function_ = nullptr;
+}
+
+//}
+
+/* workerLoop() //{ */
+
+void ThreadPool::workerLoop(size_t thread_idx) {
+  size_t generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_start_.wait(lock, [this, generation] { return stop_ || generation_ != generation; });
+      if (stop_) {
+        return;
+      }
+      generation = generation_;
+    }
+
+    runLoop(thread_idx);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--active_workers_ == 0) {
+      condition_done_.notify_one();
+    }
+  }
+}
+
+//}
+
+/* runLoop() //{ */
+
+void ThreadPool::runLoop(size_t thread_idx) {
+  in_parallel_loop = true;
+  for (size_t i = next_index_++; i < n_; i = next_index_++) {
+    (*function_)(i, thread_idx);
+  }
+  in_parallel_loop = false;
+}
+
+//}
+
+}  // namespace eth_trajectory_generation
@@ -248,26 +248,33 @@ bool Trajectory::computeMinMaxMagnitude(int derivative, const std::vector<int>&
   minimum->value = std::numeric_limits<double>::max();
   maximum->value = std::numeric_limits<double>::lowest();
 
-  // For all segments in the trajectory:
-  for (size_t segment_idx = 0; segment_idx < segments_.size(); segment_idx++) {
+  // The segments are independent, their extrema are computed in parallel.
+  std::vector<Extremum> segment_minima(segments_.size()), segment_maxima(segments_.size());
+  std::vector<char>     segment_success(segments_.size(), false);
+
+  ThreadPool::getGlobalPool().parallelFor(segments_.size(), parallel_segment_threshold_, [&](size_t segment_idx, size_t /* thread_idx */) {
     // Compute candidates.
     std::vector<Extremum> candidates;
     if (!segments_[segment_idx].computeMinMaxMagnitudeCandidates(derivative, 0.0, segments_[segment_idx].getTime(), dimensions, &candidates)) {
-      return false;
+      return;
     }
     // Evaluate candidates.
-    Extremum minimum_candidate, maximum_candidate;
-    if (!segments_[segment_idx].selectMinMaxMagnitudeFromCandidates(derivative, 0.0, segments_[segment_idx].getTime(), dimensions, candidates,
-                                                                    &minimum_candidate, &maximum_candidate)) {
+    segment_success[segment_idx] = segments_[segment_idx].selectMinMaxMagnitudeFromCandidates(
+        derivative, 0.0, segments_[segment_idx].getTime(), dimensions, candidates, &segment_minima[segment_idx], &segment_maxima[segment_idx]);
+  });
+
+  // For all segments in the trajectory:
+  for (size_t segment_idx = 0; segment_idx < segments_.size(); segment_idx++) {
+    if (!segment_success[segment_idx]) {
       return false;
     }
     // Select minimum / maximum.
-    if (minimum_candidate < *minimum) {
-      *minimum             = minimum_candidate;
+    if (segment_minima[segment_idx] < *minimum) {
+      *minimum             = segment_minima[segment_idx];
       minimum->segment_idx = static_cast<int>(segment_idx);
     }
-    if (maximum_candidate > *maximum) {
-      *maximum             = maximum_candidate;
+    if (segment_maxima[segment_idx] > *maximum) {
+      *maximum             = segment_maxima[segment_idx];
       maximum->segment_idx = static_cast<int>(segment_idx);
     }
   }
@@ -473,63 +480,52 @@ bool Trajectory::scaleSegmentTimes(double scaling) {
 
 //}
 
-/* scaleSegmentTimesToMeetConstraints() //{ */
+/* scaleSegmentTime() //{ */
 
-// This method SCALES the segment times evenly to ensure that the trajectory
-// is feasible given the provided v_max and a_max. Does not change the shape
-// of the trajectory, and only *increases* segment times.
-bool Trajectory::scaleSegmentTimesToMeetConstraints(double v_max, double a_max) {
-  // In vast majority of cases, this will converge within 1 iteration.
-  constexpr size_t kMaxCounter = 20;
-  constexpr double kTolerance  = 1e-3;
-
-  bool within_range = false;
-
-  for (size_t i = 0; i < kMaxCounter; i++) {
-
-    for (size_t seg = 0; seg < segments_.size(); seg++) {
+void Trajectory::scaleSegmentTime(size_t seg, double scaling) {
+  if (scaling == 1.0)
+    return;
 
-      // From Liu, Sikang, et al. "Planning Dynamically Feasible Trajectories for
-      // Quadrotors Using Safe Flight Corridors in 3-D Complex Environments." IEEE
-      // Robotics and Automation Letters 2.3 (2017).
-      double v_max_actual, a_max_actual;
-      computeMaxVelocityAndAcceleration(&v_max_actual, &a_max_actual, seg);
+  double scaling_inverse = 1.0 / scaling;
+  double new_time        = segments_[seg].getTime() * scaling;
+  for (int d = 0; d < segments_[seg].D(); d++) {
+    (segments_[seg])[d].scalePolynomialInTime(scaling_inverse);
+  }
 
-      // Reevaluate constraint/bound violation
-      double velocity_violation     = v_max_actual / v_max;
-      double acceleration_violation = a_max_actual / a_max;
+  max_time_ += new_time - segments_[seg].getTime();
+  segments_[seg].setTime(new_time);
+}
 
-      within_range = velocity_violation <= 1.0 + kTolerance && acceleration_violation <= 1.0 + kTolerance;
+//}
 
-      double violation_scaling = std::max(1.0, std::max(velocity_violation, sqrt(acceleration_violation)));
+/* scaleSegmentTimesToMeetConstraints() //{ */
 
-      // First figure out how to stretch the trajectory in time.
-      double violation_scaling_inverse = 1.0 / violation_scaling;
+// This method SCALES the segment times evenly to ensure that the trajectory
+// is feasible given the provided v_max and a_max. Does not change the shape
+// of the trajectory, and only *increases* segment times.
+bool Trajectory::scaleSegmentTimesToMeetConstraints(double v_max, double a_max) {
+  // From Liu, Sikang, et al. "Planning Dynamically Feasible Trajectories for
+  // Quadrotors Using Safe Flight Corridors in 3-D Complex Environments." IEEE
+  // Robotics and Automation Letters 2.3 (2017).
+  //
+  // Stretching a segment by s scales its velocity by 1/s and its acceleration
+  // by 1/s^2, so the scaling of each segment follows directly from its
+  // unscaled extrema, and a single pass is enough.
+  bool extrema_found = true;
 
-      // Scale the segment times of each segment.
-      double new_max_time = 0.0;
-      double new_time     = segments_[seg].getTime() * violation_scaling;
-      for (int d = 0; d < segments_[seg].D(); d++) {
-        (segments_[seg])[d].scalePolynomialInTime(violation_scaling_inverse);
-      }
-      segments_[seg].setTime(new_time);
-      new_max_time += new_time;
-      max_time_ = new_max_time;
-    }
+  for (size_t seg = 0; seg < segments_.size(); seg++) {
 
     double v_max_actual, a_max_actual;
-    computeMaxVelocityAndAcceleration(&v_max_actual, &a_max_actual);
-
-    // Reevaluate constraint/bound violation
-    double velocity_violation     = v_max_actual / v_max;
-    double acceleration_violation = a_max_actual / a_max;
-
-    within_range = velocity_violation <= 1.0 + kTolerance && acceleration_violation <= 1.0 + kTolerance;
-    if (within_range) {
-      break;
+    if (!computeMaxVelocityAndAcceleration(&v_max_actual, &a_max_actual, seg)) {
+      extrema_found = false;
+      continue;
     }
+
+    scaleSegmentTime(seg, std::max(1.0, std::max(v_max_actual / v_max, sqrt(a_max_actual / a_max))));
   }
-  return within_range;
+
+  // the segments, whose extrema could not be computed, are not checked
+  return extrema_found;
 }
 
 //}
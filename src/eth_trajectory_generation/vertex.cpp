@@ -20,6 +20,7 @@
 
 #include <random>
 #include <iostream>
+#include <numeric>
 
 #include <eth_trajectory_generation/vertex.h>
 
@@ -260,8 +261,16 @@ std::ostream& operator<<(std::ostream& stream, const std::vector<Vertex>& vertic
 
 /* estimateSegmentTimes() //{ */
 
-std::vector<double> estimateSegmentTimes(const Vertex::Vector& vertices, double v_max, double a_max, double j_max) {
-  return estimateSegmentTimesEuclidean(vertices, v_max);
+std::vector<double> estimateSegmentTimes(const Vertex::Vector& vertices, double v_max, double a_max, double j_max, SegmentTimeEstimator estimator) {
+
+  switch (estimator) {
+    case kSegmentTimesVelocityRamp:
+      return estimateSegmentTimesVelocityRamp(vertices, v_max, a_max);
+    case kSegmentTimesBaca:
+      return estimateSegmentTimesBaca(vertices, v_max, a_max, j_max);
+    default:
+      return estimateSegmentTimesEuclidean(vertices, v_max);
+  }
 }
 
 //}
@@ -290,6 +299,47 @@ std::vector<double> estimateSegmentTimesVelocityRamp(const Vertex::Vector& verti
 
 //}
 
+/* interpolateSegmentTimes() //{ */
+
+std::vector<double> interpolateSegmentTimes(const Vertex::Vector& vertices, const std::vector<size_t>& coarse_indices,
+                                            const std::vector<double>& coarse_segment_times) {
+  CHECK_GE(coarse_indices.size(), 2);
+  CHECK_EQ(coarse_indices.size(), coarse_segment_times.size() + 1);
+  CHECK_EQ(coarse_indices.front(), 0);
+  CHECK_EQ(coarse_indices.back(), vertices.size() - 1);
+
+  std::vector<double> segment_times;
+  segment_times.reserve(vertices.size() - 1);
+
+  for (size_t i = 0; i < coarse_segment_times.size(); ++i) {
+    const size_t first = coarse_indices[i];
+    const size_t last  = coarse_indices[i + 1];
+    CHECK_LT(first, last);
+
+    std::vector<double> lengths;
+    lengths.reserve(last - first);
+
+    for (size_t j = first; j < last; ++j) {
+      Eigen::VectorXd start, end;
+      vertices[j].getConstraint(derivative_order::POSITION, &start);
+      vertices[j + 1].getConstraint(derivative_order::POSITION, &end);
+      lengths.push_back((end - start).norm());
+    }
+
+    const double length = std::accumulate(lengths.begin(), lengths.end(), 0.0);
+
+    // Equal shares of a coarse segment, which does not move.
+    for (const double segment_length : lengths) {
+      const double share = length > 0.0 ? segment_length / length : 1.0 / lengths.size();
+      segment_times.push_back(share * coarse_segment_times[i]);
+    }
+  }
+
+  return segment_times;
+}
+
+//}
+
 /* estimateSegmentTimesBaca() //{ */
 
 std::vector<double> estimateSegmentTimesBaca(const Vertex::Vector& vertices, double v_max, double a_max, double j_max) {
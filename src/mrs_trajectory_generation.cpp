@@ -14,7 +14,10 @@
 #include <mrs_msgs/PathSrv.h>
 #include <mrs_msgs/PositionCommand.h>
 
-#include <eth_trajectory_generation/impl/polynomial_optimization_nonlinear_impl.h>
+#include <eth_trajectory_generation/polynomial_optimization_dispatch.h>
+#include <eth_trajectory_generation/polynomial_optimization_nonlinear.h>
+#include <eth_trajectory_generation/polynomial_optimization_single_segment.h>
+#include <eth_trajectory_generation/thread_pool.h>
 #include <eth_trajectory_generation/trajectory.h>
 #include <eth_trajectory_generation/trajectory_sampling.h>
 
@@ -27,6 +30,10 @@
 #include <dynamic_reconfigure/server.h>
 #include <mrs_uav_trajectory_generation/drsConfig.h>
 
+#include <algorithm>
+#include <numeric>
+#include <variant>
+
 //}
 
 /* using //{ */
@@ -48,6 +55,15 @@ typedef struct
   bool            stop_at;
 } Waypoint_t;
 
+typedef struct
+{
+  bool   safe;
+  double max_deviation;        // the maximum distance of the trajectory from the segment
+  double max_deviation_coeff;  // where the maximum distance is along the segment, 0 at its start, 1 at its end
+  size_t samples_begin;        // the samples of the trajectory within the segment, [begin, end)
+  size_t samples_end;
+} SegmentDeviation_t;
+
 //}
 
 namespace mrs_uav_trajectory_generation
@@ -68,6 +84,15 @@ private:
   Eigen::MatrixXd _yaml_path_;
 
   double _path_min_waypoint_distance_;
+
+  bool   _coarse_to_fine_enabled_;
+  int    _coarse_to_fine_min_waypoints_;
+  int    _coarse_to_fine_decimation_;
+  double _coarse_to_fine_min_time_;
+
+  bool   _path_simplification_enabled_;
+  double _path_simplification_tolerance_;
+  double _path_simplification_max_heading_error_;
   double _sampling_dt_;
 
   bool   _noise_enabled_;
@@ -77,6 +102,20 @@ private:
   double _trajectory_max_segment_deviation_;
   int    _trajectory_max_segment_deviation_max_iterations_;
   bool   _max_deviation_first_segment_;
+  bool   _trajectory_max_segment_deviation_in_optimizer_;
+
+  int _dense_solver_threshold_;
+  int _parallel_segment_threshold_;
+
+  bool _heading_separately_;
+
+  bool _single_segment_fast_path_;
+
+  int _polynomial_coefficients_;
+
+  int _segment_time_estimator_;
+
+  bool _full_stop_;
 
   // | -------- variable parameters (come with the path) -------- |
 
@@ -87,18 +126,21 @@ private:
   bool        override_constraints_ = false;
   double      override_max_velocity_;
   double      override_max_acceleration_;
+  bool        time_scaling_only_ = false;
 
   // service client for testing
   bool               callbackTest(std_srvs::Trigger::Request& req, std_srvs::Trigger::Response& res);
   ros::ServiceServer service_server_test_;
 
-  // service client for input
-  bool               callbackPathSrv(mrs_msgs::PathSrv::Request& req, mrs_msgs::PathSrv::Response& res);
+  // service client for input, the time scaling variant skips the time optimization
+  bool               callbackPathSrv(mrs_msgs::PathSrv::Request& req, mrs_msgs::PathSrv::Response& res, const bool time_scaling_only);
   ros::ServiceServer service_server_path_;
+  ros::ServiceServer service_server_path_time_scaling_;
 
-  // subscriber for input
-  void            callbackPath(const mrs_msgs::PathConstPtr& msg);
+  // subscriber for input, the time scaling variant skips the time optimization
+  void            callbackPath(const mrs_msgs::PathConstPtr& msg, const bool time_scaling_only);
   ros::Subscriber subscriber_path_;
+  ros::Subscriber subscriber_path_time_scaling_;
 
   void                          callbackConstraints(const mrs_msgs::DynamicsConstraintsConstPtr& msg);
   ros::Subscriber               subscriber_constraints_;
@@ -112,6 +154,61 @@ private:
   mrs_msgs::PositionCommand position_cmd_;
   std::mutex                mutex_position_cmd_;
 
+  // | ----------------------- diagnostics ---------------------- |
+
+  // plannings finished after their deadline, out of all plannings with a deadline
+  int        n_plannings_with_deadline_ = 0;
+  int        n_deadline_misses_         = 0;
+
+  // plannings of the subsectioned paths after the first one, out of all the requests
+  int        n_requests_ = 0;
+  int        n_replans_  = 0;
+  std::mutex mutex_diagnostics_;
+
+  // | ----------------------- replanning ----------------------- |
+
+  bool   _replanning_enabled_;
+  double _replanning_rate_;
+  double _replanning_cycle_budget_;
+
+  // one per supported number of coefficients, null if there is no path to re-plan
+  typedef std::variant<std::shared_ptr<eth_trajectory_generation::PolynomialOptimizationNonLinear<8>>,
+                       std::shared_ptr<eth_trajectory_generation::PolynomialOptimizationNonLinear<10>>,
+                       std::shared_ptr<eth_trajectory_generation::PolynomialOptimizationNonLinear<12>>,
+                       std::shared_ptr<eth_trajectory_generation::PolynomialOptimizationNonLinear<14>>>
+      OptimizerPtr_t;
+
+  typedef struct
+  {
+    OptimizerPtr_t                            optimizer;         // of the position (and the heading), re-solved in every cycle
+    eth_trajectory_generation::Vertex::Vector vertices_heading;  // if the heading is solved separately
+    double                                    start_heading;     // unwrapped heading at the start of the trajectory
+    ros::Time                                 start_time;        // of the last published trajectory
+    std::string                               frame_id;          // of the path request
+    bool                                      fly_now     = false;
+    bool                                      use_heading = false;
+  } Replanning_t;
+
+  // the path of the last published trajectory is re-planned periodically from the current position cmd
+  void       timerReplanning(const ros::TimerEvent& event);
+  ros::Timer timer_replanning_;
+
+  // the optimizer of the last planned path, re-planned once its trajectory is published
+  void startReplanning(const ros::Time& start_time);
+
+  // a new path request replaces the re-planned path
+  void stopReplanning();
+
+  Replanning_t replanning_;
+  Replanning_t replanning_next_;
+  std::mutex   mutex_replanning_;
+
+  // cycle time statistics of the re-planned path, overruns = optimizations stopped by the cycle budget
+  int    replanning_n_cycles_       = 0;
+  int    replanning_n_overruns_     = 0;
+  double replanning_cycle_time_sum_ = 0;
+  double replanning_cycle_time_max_ = 0;
+
   // generate random number on the inteval [from, to]
   double randd(const double from, const double to);
 
@@ -131,20 +228,62 @@ private:
    * @brief validates samples of a trajectory agains a path of waypoints
    *
    * @param trajectory
-   * @param segments
+   * @param segment_times the times of the trajectory segments, one per path segment
+   * @param waypoints
    *
-   * @return <success, traj_fail_idx, path_fail_segment>
+   * @return <success, traj_fail_idx, the deviation of each path segment, max_deviation>
    */
-  std::tuple<bool, int, std::vector<bool>, double> validateTrajectory(const eth_mav_msgs::EigenTrajectoryPoint::Vector& trajectory,
-                                                                      const std::vector<Waypoint_t>&                    waypoints);
+  std::tuple<bool, int, std::vector<SegmentDeviation_t>, double> validateTrajectory(const eth_mav_msgs::EigenTrajectoryPoint::Vector& trajectory,
+                                                                                    const std::vector<double>&                        segment_times,
+                                                                                    const std::vector<Waypoint_t>&                    waypoints);
 
-  std::optional<eth_mav_msgs::EigenTrajectoryPoint::Vector> findTrajectory(const std::vector<Waypoint_t>&   waypoints,
-                                                                           const mrs_msgs::PositionCommand& initial_state);
+  /**
+   * @brief subsections the path segments violating the maximum deviation, the number of the new waypoints grows with the violation, the first one is
+   * placed at the maximum deviation
+   *
+   * @param waypoints
+   * @param segment_deviations the result of validateTrajectory()
+   *
+   * @return the number of the new waypoints
+   */
+  int subsectionPath(std::vector<Waypoint_t>& waypoints, const std::vector<SegmentDeviation_t>& segment_deviations);
 
-  mrs_msgs::TrajectoryReference getTrajectoryReference(const eth_mav_msgs::EigenTrajectoryPoint::Vector& trajectory, const ros::Time& stamp);
+  /**
+   * @brief plans a trajectory through the waypoints
+   *
+   * @param waypoints
+   * @param initial_state
+   * @param max_time the time for the optimization [s], the best trajectory found until then is returned, disabled if not positive
+   * @param replanning if not null, the optimizer is kept in it for re-planning (the single segment fast path is not used then), not kept if the path
+   * is split at full stops
+   *
+   * @return <trajectory, segment times, converged>
+   */
+  std::optional<std::tuple<eth_mav_msgs::EigenTrajectoryPoint::Vector, std::vector<double>, bool>> findTrajectory(const std::vector<Waypoint_t>& waypoints,
+                                                                                                                  const mrs_msgs::PositionCommand& initial_state,
+                                                                                                                  const double                     max_time,
+                                                                                                                  Replanning_t* replanning = nullptr);
+
+  eth_trajectory_generation::Vertex createStartVertex(const Eigen::Vector4d& position, const mrs_msgs::PositionCommand& state, const int derivative_to_optimize);
+
+  mrs_msgs::TrajectoryReference getTrajectoryReference(const eth_mav_msgs::EigenTrajectoryPoint::Vector& trajectory, const ros::Time& stamp,
+                                                       const std::string& frame_id, const bool fly_now, const bool use_heading);
 
   Waypoint_t interpolatePoint(const Waypoint_t& a, const Waypoint_t& b, const double& coeff);
 
+  /**
+   * @brief removes the waypoints, which are within the tolerance from the simplified path (Douglas-Peucker), the first and the last waypoint and the
+   * stops are kept
+   *
+   * @param waypoints
+   * @param tolerance the maximum distance of a removed waypoint from the simplified path [m]
+   * @param max_heading_error the maximum difference of the heading of a removed waypoint from the heading interpolated along the simplified path
+   * [rad], not checked if not positive
+   *
+   * @return the simplified path
+   */
+  std::vector<Waypoint_t> simplifyPath(const std::vector<Waypoint_t>& waypoints, const double tolerance, const double max_heading_error);
+
   double distFromSegment(const vec3_t& point, const vec3_t& seg1, const vec3_t& seg2);
 
   bool trajectorySrv(const mrs_msgs::TrajectoryReference& msg);
@@ -175,12 +314,21 @@ void MrsTrajectoryGeneration::onInit() {
 
   subscriber_constraints_  = nh_.subscribe("constraints_in", 1, &MrsTrajectoryGeneration::callbackConstraints, this, ros::TransportHints().tcpNoDelay());
   subscriber_position_cmd_ = nh_.subscribe("position_cmd_in", 1, &MrsTrajectoryGeneration::callbackPositionCmd, this, ros::TransportHints().tcpNoDelay());
-  subscriber_path_         = nh_.subscribe("path_in", 1, &MrsTrajectoryGeneration::callbackPath, this, ros::TransportHints().tcpNoDelay());
+
+  subscriber_path_ = nh_.subscribe<mrs_msgs::Path>("path_in", 1, boost::bind(&MrsTrajectoryGeneration::callbackPath, this, _1, false), ros::VoidConstPtr(),
+                                                   ros::TransportHints().tcpNoDelay());
+  subscriber_path_time_scaling_ = nh_.subscribe<mrs_msgs::Path>("path_time_scaling_in", 1, boost::bind(&MrsTrajectoryGeneration::callbackPath, this, _1, true),
+                                                                ros::VoidConstPtr(), ros::TransportHints().tcpNoDelay());
 
   // | --------------------- service servers -------------------- |
 
   service_server_test_ = nh_.advertiseService("test_in", &MrsTrajectoryGeneration::callbackTest, this);
-  service_server_path_ = nh_.advertiseService("path_in", &MrsTrajectoryGeneration::callbackPathSrv, this);
+
+  service_server_path_ = nh_.advertiseService<mrs_msgs::PathSrv::Request, mrs_msgs::PathSrv::Response>(
+      "path_in", boost::bind(&MrsTrajectoryGeneration::callbackPathSrv, this, _1, _2, false));
+
+  service_server_path_time_scaling_ = nh_.advertiseService<mrs_msgs::PathSrv::Request, mrs_msgs::PathSrv::Response>(
+      "path_time_scaling_in", boost::bind(&MrsTrajectoryGeneration::callbackPathSrv, this, _1, _2, true));
 
   service_client_trajectory_reference_ = nh_.serviceClient<mrs_msgs::TrajectoryReferenceSrv>("trajectory_reference_out");
 
@@ -199,6 +347,13 @@ void MrsTrajectoryGeneration::onInit() {
   param_loader.loadParam("add_noise/max", _noise_max_);
 
   param_loader.loadParam("path_min_waypoint_distance", _path_min_waypoint_distance_);
+  param_loader.loadParam("coarse_to_fine/enabled", _coarse_to_fine_enabled_);
+  param_loader.loadParam("coarse_to_fine/min_waypoints", _coarse_to_fine_min_waypoints_);
+  param_loader.loadParam("coarse_to_fine/decimation", _coarse_to_fine_decimation_);
+  param_loader.loadParam("coarse_to_fine/min_time", _coarse_to_fine_min_time_);
+  param_loader.loadParam("path_simplification/enabled", _path_simplification_enabled_);
+  param_loader.loadParam("path_simplification/tolerance", _path_simplification_tolerance_);
+  param_loader.loadParam("path_simplification/max_heading_error", _path_simplification_max_heading_error_);
 
   param_loader.loadParam("sampling_dt", _sampling_dt_);
 
@@ -206,6 +361,24 @@ void MrsTrajectoryGeneration::onInit() {
   param_loader.loadParam("check_trajectory_deviation/max_deviation", _trajectory_max_segment_deviation_);
   param_loader.loadParam("check_trajectory_deviation/first_segment", _max_deviation_first_segment_);
   param_loader.loadParam("check_trajectory_deviation/max_iterations", _trajectory_max_segment_deviation_max_iterations_);
+  param_loader.loadParam("check_trajectory_deviation/in_optimizer", _trajectory_max_segment_deviation_in_optimizer_);
+
+  param_loader.loadParam("dense_solver_threshold", _dense_solver_threshold_);
+  param_loader.loadParam("parallel_segment_threshold", _parallel_segment_threshold_);
+
+  param_loader.loadParam("heading_separately", _heading_separately_);
+
+  param_loader.loadParam("single_segment_fast_path", _single_segment_fast_path_);
+
+  param_loader.loadParam("polynomial_coefficients", _polynomial_coefficients_);
+
+  param_loader.loadParam("segment_time_estimator", _segment_time_estimator_);
+
+  param_loader.loadParam("full_stop", _full_stop_);
+
+  param_loader.loadParam("replanning/enabled", _replanning_enabled_);
+  param_loader.loadParam("replanning/rate", _replanning_rate_);
+  param_loader.loadParam("replanning/cycle_budget", _replanning_cycle_budget_);
 
   // | --------------------- service clients -------------------- |
 
@@ -217,12 +390,41 @@ void MrsTrajectoryGeneration::onInit() {
   param_loader.loadParam("inequality_constraint_tolerance", params_.inequality_constraint_tolerance);
   param_loader.loadParam("max_iterations", params_.max_iterations);
   param_loader.loadParam("derivative_to_optimize", params_.derivative_to_optimize);
+  param_loader.loadParam("max_planning_time", params_.max_planning_time);
 
   if (!param_loader.loadedSuccessfully()) {
     ROS_ERROR("[MrsTrajectoryGeneration]: could not load all parameters!");
     ros::shutdown();
   }
 
+  if (_polynomial_coefficients_ != 0 && !eth_trajectory_generation::isSupportedN(_polynomial_coefficients_)) {
+    ROS_ERROR("[MrsTrajectoryGeneration]: polynomial_coefficients = %d is not supported, use 0, 8, 10, 12 or 14", _polynomial_coefficients_);
+    ros::shutdown();
+  }
+
+  if (_segment_time_estimator_ < eth_trajectory_generation::kSegmentTimesEuclidean || _segment_time_estimator_ > eth_trajectory_generation::kSegmentTimesBaca) {
+    ROS_ERROR("[MrsTrajectoryGeneration]: segment_time_estimator = %d is not supported, use 0, 1 or 2", _segment_time_estimator_);
+    ros::shutdown();
+  }
+
+  if (_coarse_to_fine_decimation_ < 2) {
+    ROS_ERROR("[MrsTrajectoryGeneration]: coarse_to_fine/decimation = %d is not supported, use 2 or more", _coarse_to_fine_decimation_);
+    ros::shutdown();
+  }
+
+  if (_trajectory_max_segment_deviation_enabled_ && _trajectory_max_segment_deviation_in_optimizer_ && !_heading_separately_) {
+    ROS_ERROR("[MrsTrajectoryGeneration]: check_trajectory_deviation/in_optimizer requires heading_separately, the corridor would constrain the heading too");
+    ros::shutdown();
+  }
+
+  // ros::Rate(0) would throw while creating the timer
+  if (_replanning_enabled_ && (_replanning_rate_ <= 0 || _replanning_cycle_budget_ <= 0)) {
+    ROS_ERROR("[MrsTrajectoryGeneration]: replanning/rate = %.3f and replanning/cycle_budget = %.3f have to be positive", _replanning_rate_,
+              _replanning_cycle_budget_);
+    ros::shutdown();
+    return;
+  }
+
   // | -------------------- batch visualizer -------------------- |
 
   // TODO should be visualizer in the same frame as the data come in
@@ -244,6 +446,12 @@ void MrsTrajectoryGeneration::onInit() {
   Drs_t::CallbackType f = boost::bind(&MrsTrajectoryGeneration::callbackDrs, this, _1, _2);
   drs_->setCallback(f);
 
+  // | ------------------------- timers ------------------------- |
+
+  if (_replanning_enabled_) {
+    timer_replanning_ = nh_.createTimer(ros::Rate(_replanning_rate_), &MrsTrajectoryGeneration::timerReplanning, this);
+  }
+
   // | --------------------- finish the init -------------------- |
 
   ROS_INFO_ONCE("[MrsTrajectoryGeneration]: initialized");
@@ -257,22 +465,35 @@ void MrsTrajectoryGeneration::onInit() {
 
 /* validateTrajectory() //{ */
 
-std::tuple<bool, int, std::vector<bool>, double> MrsTrajectoryGeneration::validateTrajectory(const eth_mav_msgs::EigenTrajectoryPoint::Vector& trajectory,
-                                                                                             const std::vector<Waypoint_t>&                    waypoints) {
+std::tuple<bool, int, std::vector<SegmentDeviation_t>, double> MrsTrajectoryGeneration::validateTrajectory(
+    const eth_mav_msgs::EigenTrajectoryPoint::Vector& trajectory, const std::vector<double>& segment_times, const std::vector<Waypoint_t>& waypoints) {
 
   // prepare the output
 
-  std::vector<bool> segments;
+  std::vector<SegmentDeviation_t> segments;
   for (size_t i = 0; i < waypoints.size() - 1; i++) {
-    segments.push_back(true);
+    segments.push_back({true, 0.0, 0.5, 0, 0});
   }
 
-  int waypoint_idx = 0;
+  // the trajectory segment i goes from the waypoint i to the waypoint i+1, the segment of a sample thus follows from its time, even if the path
+  // crosses or overlaps itself
+  int    waypoint_idx     = 0;
+  double segment_end_time = segment_times.empty() ? 0.0 : segment_times.front();
 
   bool   is_safe       = true;
   double max_deviation = 0;
 
-  for (size_t i = 0; i < trajectory.size() - 1; i++) {
+  for (size_t i = 0; i < trajectory.size(); i++) {
+
+    const double sample_time = trajectory[i].time_from_start_ns * 1e-9;
+
+    // the sample at the end of a segment belongs to it, the samples are rounded to nanoseconds
+    while (sample_time > segment_end_time + 1e-6 && waypoint_idx < int(segment_times.size()) - 1) {
+      segments.at(waypoint_idx).samples_end = i;
+      waypoint_idx++;
+      segments.at(waypoint_idx).samples_begin = i;
+      segment_end_time += segment_times.at(waypoint_idx);
+    }
 
     // the trajectory sample
     double sample_x = trajectory[i].position_W[0];
@@ -280,12 +501,6 @@ std::tuple<bool, int, std::vector<bool>, double> MrsTrajectoryGeneration::valida
     double sample_z = trajectory[i].position_W[2];
     vec3_t sample   = vec3_t(sample_x, sample_y, sample_z);
 
-    // next sample
-    double next_sample_x = trajectory[i + 1].position_W[0];
-    double next_sample_y = trajectory[i + 1].position_W[1];
-    double next_sample_z = trajectory[i + 1].position_W[2];
-    vec3_t next_sample   = vec3_t(next_sample_x, next_sample_y, next_sample_z);
-
     // segment start
     double segment_start_x = waypoints.at(waypoint_idx).coords[0];
     double segment_start_y = waypoints.at(waypoint_idx).coords[1];
@@ -300,37 +515,76 @@ std::tuple<bool, int, std::vector<bool>, double> MrsTrajectoryGeneration::valida
 
     double distance_from_segment = distFromSegment(sample, segment_start, segment_end);
 
-    double segment_end_dist = distFromSegment(segment_end, sample, next_sample);
-
     if (waypoint_idx > 0 || _max_deviation_first_segment_) {
 
       if (distance_from_segment > max_deviation) {
         max_deviation = distance_from_segment;
       }
 
-      if (distance_from_segment > _trajectory_max_segment_deviation_) {
-        segments.at(waypoint_idx) = false;
-        is_safe                   = false;
+      SegmentDeviation_t& segment = segments.at(waypoint_idx);
+
+      if (distance_from_segment > segment.max_deviation) {
+
+        segment.max_deviation = distance_from_segment;
+
+        vec3_t segment_vector = segment_end - segment_start;
+        double segment_len_sq = segment_vector.squaredNorm();
+
+        if (segment_len_sq > 0) {
+          segment.max_deviation_coeff = std::clamp(segment_vector.dot(sample - segment_start) / segment_len_sq, 0.0, 1.0);
+        }
       }
-    }
 
-    if (segment_end_dist < 0.05 && waypoint_idx < (int(waypoints.size()) - 2)) {
-      waypoint_idx++;
+      if (distance_from_segment > _trajectory_max_segment_deviation_) {
+        segment.safe = false;
+        is_safe      = false;
+      }
     }
   }
 
+  segments.at(waypoint_idx).samples_end = trajectory.size();
+
   return std::tuple(is_safe, trajectory.size(), segments, max_deviation);
 }
 
 //}
 
+/* createStartVertex() //{ */
+
+eth_trajectory_generation::Vertex MrsTrajectoryGeneration::createStartVertex(const Eigen::Vector4d& position, const mrs_msgs::PositionCommand& state,
+                                                                             const int derivative_to_optimize) {
+
+  eth_trajectory_generation::Vertex vertex(4);
+
+  vertex.makeStartOrEnd(position, derivative_to_optimize);
+
+  vertex.addConstraint(eth_trajectory_generation::derivative_order::POSITION, position);
+
+  vertex.addConstraint(eth_trajectory_generation::derivative_order::VELOCITY,
+                       Eigen::Vector4d(state.velocity.x, state.velocity.y, state.velocity.z, state.heading_rate));
+
+  vertex.addConstraint(eth_trajectory_generation::derivative_order::ACCELERATION,
+                       Eigen::Vector4d(state.acceleration.x, state.acceleration.y, state.acceleration.z, state.heading_acceleration));
+
+  vertex.addConstraint(eth_trajectory_generation::derivative_order::JERK, Eigen::Vector4d(state.jerk.x, state.jerk.y, state.jerk.z, state.heading_jerk));
+
+  return vertex;
+}
+
+//}
+
 /* findTrajectory() //{ */
 
-std::optional<eth_mav_msgs::EigenTrajectoryPoint::Vector> MrsTrajectoryGeneration::findTrajectory(const std::vector<Waypoint_t>&   waypoints,
-                                                                                                  const mrs_msgs::PositionCommand& initial_state) {
+std::optional<std::tuple<eth_mav_msgs::EigenTrajectoryPoint::Vector, std::vector<double>, bool>> MrsTrajectoryGeneration::findTrajectory(
+    const std::vector<Waypoint_t>& waypoints, const mrs_msgs::PositionCommand& initial_state, const double max_time, Replanning_t* replanning) {
 
   ROS_DEBUG("[MrsTrajectoryGeneration]: planning");
 
+  // the optimizations in a plan share the max_time
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  auto remaining_time = [&]() { return max_time - std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
   auto params      = mrs_lib::get_mutexed(mutex_params_, params_);
   auto constraints = mrs_lib::get_mutexed(mutex_constraints_, constraints_);
 
@@ -344,13 +598,25 @@ std::optional<eth_mav_msgs::EigenTrajectoryPoint::Vector> MrsTrajectoryGeneratio
   parameters.use_soft_constraints   = params.soft_constraints_enabled;
   parameters.soft_constraint_weight = params.soft_constraints_weight;
   parameters.time_alloc_method      = static_cast<eth_trajectory_generation::NonlinearOptimizationParameters::TimeAllocMethod>(params.time_allocation);
+  if (time_scaling_only_) {
+    parameters.time_alloc_method = eth_trajectory_generation::NonlinearOptimizationParameters::kTimeScalingOnly;
+  }
   if (params.time_allocation == 2) {
     parameters.algorithm = nlopt::LD_LBFGS;
+  } else if (params.time_allocation == 3 || params.time_allocation == 4) {
+    // the gradients are analytic, hard constraints need an algorithm supporting them
+    parameters.algorithm = params.soft_constraints_enabled ? nlopt::LD_LBFGS : nlopt::LD_MMA;
   }
   parameters.initial_stepsize_rel            = 0.1;
   parameters.inequality_constraint_tolerance = params.inequality_constraint_tolerance;
   parameters.equality_constraint_tolerance   = params.equality_constraint_tolerance;
   parameters.max_iterations                  = params.max_iterations;
+  parameters.max_time                        = max_time;
+  parameters.dense_solver_threshold          = _dense_solver_threshold_;
+  parameters.parallel_segment_threshold      = _parallel_segment_threshold_;
+
+  const eth_trajectory_generation::SegmentTimeEstimator segment_time_estimator =
+      static_cast<eth_trajectory_generation::SegmentTimeEstimator>(_segment_time_estimator_);
 
   eth_trajectory_generation::Vertex::Vector vertices;
   const int                                 dimension = 4;
@@ -386,31 +652,42 @@ std::optional<eth_mav_msgs::EigenTrajectoryPoint::Vector> MrsTrajectoryGeneratio
     eth_trajectory_generation::Vertex vertex(dimension);
 
     if (i == 0) {
-      vertex.makeStartOrEnd(Eigen::Vector4d(x, y, z, heading), derivative_to_optimize);
-
-      vertex.addConstraint(eth_trajectory_generation::derivative_order::POSITION, Eigen::Vector4d(x, y, z, heading));
-
-      vertex.addConstraint(eth_trajectory_generation::derivative_order::VELOCITY,
-                           Eigen::Vector4d(initial_state.velocity.x, initial_state.velocity.y, initial_state.velocity.z, initial_state.heading_rate));
-
-      vertex.addConstraint(
-          eth_trajectory_generation::derivative_order::ACCELERATION,
-          Eigen::Vector4d(initial_state.acceleration.x, initial_state.acceleration.y, initial_state.acceleration.z, initial_state.heading_acceleration));
-
-      vertex.addConstraint(eth_trajectory_generation::derivative_order::JERK,
-                           Eigen::Vector4d(initial_state.jerk.x, initial_state.jerk.y, initial_state.jerk.z, initial_state.heading_jerk));
+      vertex = createStartVertex(Eigen::Vector4d(x, y, z, heading), initial_state, derivative_to_optimize);
     } else if (i == (waypoints.size() - 1)) {  // the last point
       vertex.makeStartOrEnd(Eigen::Vector4d(x, y, z, heading), derivative_to_optimize);
     } else {  // mid points
       vertex.addConstraint(eth_trajectory_generation::derivative_order::POSITION, Eigen::Vector4d(x, y, z, heading));
       if (waypoints.at(i).stop_at) {
         vertex.addConstraint(eth_trajectory_generation::derivative_order::VELOCITY, Eigen::Vector4d(0, 0, 0, 0));
+        if (_full_stop_) {
+          vertex.addConstraint(eth_trajectory_generation::derivative_order::ACCELERATION, Eigen::Vector4d(0, 0, 0, 0));
+          vertex.addConstraint(eth_trajectory_generation::derivative_order::JERK, Eigen::Vector4d(0, 0, 0, 0));
+        }
       }
     }
 
     vertices.push_back(vertex);
   }
 
+  // | ---------------- split the path at full stops --------------- |
+
+  // the state at a full stop is fixed up to the jerk (higher derivatives are fixed once the coefficients are known),
+  // the paths before and after it are independent
+  std::vector<eth_trajectory_generation::Vertex::Vector> paths(1);
+
+  for (size_t i = 0; i < vertices.size(); i++) {
+
+    paths.back().push_back(vertices[i]);
+
+    if (_full_stop_ && waypoints.at(i).stop_at && i > 0 && i < (vertices.size() - 1)) {
+      paths.push_back({vertices[i]});
+    }
+  }
+
+  if (paths.size() > 1) {
+    ROS_DEBUG("[MrsTrajectoryGeneration]: the path is split at full stops into %lu independent paths", paths.size());
+  }
+
   // | ---------------- compute the segment times --------------- |
 
   double v_max, a_max, j_max;
@@ -428,45 +705,252 @@ std::optional<eth_mav_msgs::EigenTrajectoryPoint::Vector> MrsTrajectoryGeneratio
 
   j_max = constraints.horizontal_jerk;
 
-  std::vector<double> segment_times, segment_times_baca;
-  segment_times      = estimateSegmentTimes(vertices, v_max, a_max, j_max);
-  segment_times_baca = estimateSegmentTimesBaca(vertices, v_max, a_max, j_max);
+  // | ------------ select the number of coefficients ------------ |
 
-  double initial_total_time      = 0;
-  double initial_total_time_baca = 0;
-  for (int i = 0; i < int(segment_times_baca.size()); i++) {
-    initial_total_time += segment_times[i];
-    initial_total_time_baca += segment_times_baca[i];
+  // the start vertex constrains the derivatives up to the jerk
+  const int min_coefficients = eth_trajectory_generation::getSmallestSupportedN(derivative_to_optimize, eth_trajectory_generation::derivative_order::JERK);
+
+  int n_coefficients = min_coefficients;
+
+  if (_polynomial_coefficients_ > 0) {
+
+    if (_polynomial_coefficients_ < min_coefficients) {
+      ROS_WARN_THROTTLE(1.0, "[MrsTrajectoryGeneration]: %d coefficients can not optimize the derivative %d and constrain the jerk, using %d",
+                        _polynomial_coefficients_, derivative_to_optimize, min_coefficients);
+    } else {
+      n_coefficients = _polynomial_coefficients_;
+    }
   }
 
-  ROS_DEBUG("[MrsTrajectoryGeneration]: initial total time (Euclidean): %.2f", initial_total_time);
-  ROS_DEBUG("[MrsTrajectoryGeneration]: initial total time (Baca): %.2f", initial_total_time_baca);
+  ROS_DEBUG("[MrsTrajectoryGeneration]: polynomials of %d coefficients", n_coefficients);
+
+  eth_trajectory_generation::Trajectory trajectory_position, trajectory_heading;
+
+  bool converged = true;
+
+  // the optimizations are instantiated for each supported number of coefficients
+  eth_trajectory_generation::dispatchN(n_coefficients, [&](auto n) {
+    constexpr int N = decltype(n)::value;
+
+    typedef eth_trajectory_generation::PolynomialOptimizationNonLinear<N> Optimizer_t;
+
+    // plans the position (and the heading) through the vertices of a path, returns whether the optimization converged
+    auto plan = [&](const eth_trajectory_generation::Vertex::Vector& path, Replanning_t* path_replanning,
+                    eth_trajectory_generation::Trajectory* path_trajectory_position, eth_trajectory_generation::Trajectory* path_trajectory_heading) {
+      // the closed form solution always converges
+      bool path_converged = true;
+
+      // | ---------- split off the heading, if it is solved separately ---------- |
+
+      eth_trajectory_generation::Vertex::Vector vertices_position, vertices_heading;
+
+      if (_heading_separately_) {
+
+        const int max_derivative = eth_trajectory_generation::PolynomialOptimization<N>::kHighestDerivativeToOptimize;
 
-  // | --------- create an optimizer object and solve it -------- |
+        for (const eth_trajectory_generation::Vertex& vertex : path) {
+
+          eth_trajectory_generation::Vertex vertex_position(3), vertex_heading(1);
+
+          vertex.getSubdimension({0, 1, 2}, max_derivative, &vertex_position);
+          vertex.getSubdimension({3}, max_derivative, &vertex_heading);
+
+          vertices_position.push_back(vertex_position);
+          vertices_heading.push_back(vertex_heading);
+        }
+
+      } else {
+        vertices_position = path;
+      }
+
+      if (_single_segment_fast_path_ && path.size() == 2 && !path_replanning) {
+
+        // | ---------- a single segment, solved in closed form ---------- |
+
+        const double initial_segment_time = estimateSegmentTimes(vertices_position, v_max, a_max, j_max, segment_time_estimator).front();
+
+        eth_trajectory_generation::PolynomialOptimizationSingleSegment<N> opt(_heading_separately_ ? 3 : dimension);
+        opt.setupFromVertices(vertices_position.front(), vertices_position.back(), initial_segment_time, derivative_to_optimize);
+        opt.addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::VELOCITY, v_max);
+        opt.addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::ACCELERATION, a_max);
+        opt.addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::JERK, j_max);
+
+        if (!opt.optimize()) {
+          ROS_WARN("[MrsTrajectoryGeneration]: the single segment could not be scaled to meet the constraints");
+        }
 
-  const int                                                     N = 10;
-  eth_trajectory_generation::PolynomialOptimizationNonLinear<N> opt(dimension, parameters);
-  opt.setupFromVertices(vertices, segment_times, derivative_to_optimize);
-  opt.addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::VELOCITY, v_max);
-  opt.addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::ACCELERATION, a_max);
-  opt.addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::JERK, j_max);
-  opt.optimize();
+        ROS_DEBUG("[MrsTrajectoryGeneration]: single segment, time %.2f s", opt.getSegmentTime());
 
-  // | ------------- obtain the polynomial segments ------------- |
+        opt.getTrajectory(path_trajectory_position);
+
+        if (_heading_separately_) {
+          eth_trajectory_generation::PolynomialOptimizationSingleSegment<N> opt_heading(1);
+          opt_heading.setupFromVertices(vertices_heading.front(), vertices_heading.back(), opt.getSegmentTime(), derivative_to_optimize);
+          opt_heading.getTrajectory(path_trajectory_heading);
+        }
+
+      } else {
+
+        std::vector<double> segment_times = estimateSegmentTimes(vertices_position, v_max, a_max, j_max, segment_time_estimator);
+
+        ROS_DEBUG("[MrsTrajectoryGeneration]: initial total time: %.2f", std::accumulate(segment_times.begin(), segment_times.end(), 0.0));
+
+        // | ---- coarse-to-fine: the segment times are seeded by the optimization of a decimated path ---- |
+
+        // with max_time, the coarse optimization gets at most half of the remaining time, it is skipped if that is too short
+        const bool coarse_to_fine_in_time = max_time <= 0 || remaining_time() >= 2.0 * _coarse_to_fine_min_time_;
+
+        if (_coarse_to_fine_enabled_ && int(vertices_position.size()) >= _coarse_to_fine_min_waypoints_ && coarse_to_fine_in_time &&
+            parameters.time_alloc_method != eth_trajectory_generation::NonlinearOptimizationParameters::kTimeScalingOnly) {
+
+          // every n-th vertex, the last one and the stops are kept
+          std::vector<size_t>                       coarse_indices;
+          eth_trajectory_generation::Vertex::Vector coarse_vertices;
+
+          for (size_t i = 0; i < vertices_position.size(); i++) {
+            if (i % _coarse_to_fine_decimation_ == 0 || i == (vertices_position.size() - 1) ||
+                vertices_position[i].hasConstraint(eth_trajectory_generation::derivative_order::VELOCITY)) {
+              coarse_indices.push_back(i);
+              coarse_vertices.push_back(vertices_position[i]);
+            }
+          }
+
+          eth_trajectory_generation::NonlinearOptimizationParameters coarse_parameters = parameters;
+
+          if (max_time > 0) {
+            coarse_parameters.max_time = 0.5 * remaining_time();
+          }
+
+          Optimizer_t coarse_opt(_heading_separately_ ? 3 : dimension, coarse_parameters);
+          coarse_opt.setupFromVertices(coarse_vertices, estimateSegmentTimes(coarse_vertices, v_max, a_max, j_max, segment_time_estimator), derivative_to_optimize);
+          coarse_opt.addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::VELOCITY, v_max);
+          coarse_opt.addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::ACCELERATION, a_max);
+          coarse_opt.addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::JERK, j_max);
+          coarse_opt.optimize();
+
+          // the full optimization scales the segment times to the constraints itself
+          std::vector<double> coarse_segment_times;
+          coarse_opt.getUnscaledSegmentTimes(&coarse_segment_times);
+
+          segment_times = eth_trajectory_generation::interpolateSegmentTimes(vertices_position, coarse_indices, coarse_segment_times);
+
+          ROS_DEBUG("[MrsTrajectoryGeneration]: coarse-to-fine: %lu coarse waypoints, initial total time %.2f, optimized in %.3f s", coarse_vertices.size(),
+                    std::accumulate(segment_times.begin(), segment_times.end(), 0.0), coarse_opt.getOptimizationInfo().optimization_time);
+        }
+
+        // | --------- create an optimizer object and solve it -------- |
+
+        std::shared_ptr<Optimizer_t> opt = std::make_shared<Optimizer_t>(_heading_separately_ ? 3 : dimension, parameters);
+        opt->setupFromVertices(vertices_position, segment_times, derivative_to_optimize);
+        opt->addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::VELOCITY, v_max);
+        opt->addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::ACCELERATION, a_max);
+        opt->addMaximumMagnitudeConstraint(eth_trajectory_generation::derivative_order::JERK, j_max);
+
+        // only the rest of the time after the preceding optimizations, e.g. the coarse one
+        if (max_time > 0) {
+          opt->setMaxTime(std::max(remaining_time(), 1e-3));
+        }
+
+        if (_trajectory_max_segment_deviation_enabled_ && _trajectory_max_segment_deviation_in_optimizer_) {
+          // only the first path starts with the segment from the current state
+          opt->addCorridorConstraint(_trajectory_max_segment_deviation_, _max_deviation_first_segment_ || &path != &paths.front());
+        }
 
-  eth_trajectory_generation::Segment::Vector segments;
-  opt.getPolynomialOptimizationRef().getSegments(&segments);
+        opt->optimize();
+
+        const eth_trajectory_generation::OptimizationInfo optimization_info = opt->getOptimizationInfo();
+
+        ROS_DEBUG("[MrsTrajectoryGeneration]: optimization took %.3f s, %d iterations, extrema cache %lu hits, %lu misses", optimization_info.optimization_time,
+                  optimization_info.n_iterations, optimization_info.extrema_cache_hits, optimization_info.extrema_cache_misses);
+
+        path_converged = optimization_info.converged();
+
+        if (!path_converged) {
+          ROS_WARN("[MrsTrajectoryGeneration]: the optimization did not converge (%s), using the best trajectory found",
+                   nlopt::returnValueToString(optimization_info.stopping_reason).c_str());
+        }
+
+        opt->getTrajectory(path_trajectory_position);
+
+        if (path_replanning) {
+          path_replanning->optimizer        = opt;
+          path_replanning->vertices_heading = vertices_heading;
+          path_replanning->start_heading    = sradians::unwrap(waypoints.front().coords[3], initial_state.heading);
+        }
+
+        if (_heading_separately_) {
+
+          // the heading is solved only once, on the final segment times of the position
+          eth_trajectory_generation::PolynomialOptimization<N> opt_heading(1);
+          opt_heading.setupFromVertices(vertices_heading, path_trajectory_position->getSegmentTimes(), derivative_to_optimize);
+          opt_heading.solveLinear();
+          opt_heading.getTrajectory(path_trajectory_heading);
+        }
+      }
+
+      return path_converged;
+    };
+
+    if (paths.size() == 1) {
+
+      converged = plan(paths.front(), replanning, &trajectory_position, &trajectory_heading);
+
+    } else {
+
+      // | ------- independent paths between the full stops, planned in parallel ------- |
+
+      // the coupled problem keeps the derivatives up to N/2-1 continuous, above the jerk they are zero at the full stops,
+      // otherwise the joined trajectory would not be continuous there
+      const int max_derivative = eth_trajectory_generation::PolynomialOptimization<N>::kHighestDerivativeToOptimize;
+
+      for (size_t i = 0; i < paths.size(); i++) {
+        for (int derivative = eth_trajectory_generation::derivative_order::JERK + 1; derivative <= max_derivative; derivative++) {
+          if (i > 0) {
+            paths[i].front().addConstraint(derivative, Eigen::VectorXd::Zero(dimension));
+          }
+          if (i < (paths.size() - 1)) {
+            paths[i].back().addConstraint(derivative, Eigen::VectorXd::Zero(dimension));
+          }
+        }
+      }
+
+      std::vector<eth_trajectory_generation::Trajectory> trajectories_position(paths.size()), trajectories_heading(paths.size());
+      std::vector<int>                                   paths_converged(paths.size());
+
+      eth_trajectory_generation::ThreadPool::getGlobalPool().parallelFor(paths.size(), 0, [&](size_t i, [[maybe_unused]] size_t thread_idx) {
+        paths_converged[i] = plan(paths[i], nullptr, &trajectories_position[i], &trajectories_heading[i]);
+      });
+
+      converged = std::find(paths_converged.begin(), paths_converged.end(), false) == paths_converged.end();
+
+      trajectories_position.front().addTrajectories({trajectories_position.begin() + 1, trajectories_position.end()}, &trajectory_position);
+
+      if (_heading_separately_) {
+        trajectories_heading.front().addTrajectories({trajectories_heading.begin() + 1, trajectories_heading.end()}, &trajectory_heading);
+      }
+    }
+  });
 
   // | --------------- create the trajectory class -------------- |
 
   eth_trajectory_generation::Trajectory trajectory;
-  opt.getTrajectory(&trajectory);
+
+  if (_heading_separately_) {
+
+    if (!trajectory_position.getTrajectoryWithAppendedDimension(trajectory_heading, &trajectory)) {
+      ROS_ERROR("[MrsTrajectoryGeneration]: could not append the heading to the trajectory");
+      return {};
+    }
+
+  } else {
+    trajectory = trajectory_position;
+  }
 
   eth_mav_msgs::EigenTrajectoryPoint::Vector states;
   bool                                       success = eth_trajectory_generation::sampleWholeTrajectory(trajectory, _sampling_dt_, &states);
 
   if (success) {
-    return std::optional(states);
+    return std::optional(std::tuple(states, trajectory.getSegmentTimes(), converged));
   } else {
     return {};
   }
@@ -480,6 +964,20 @@ std::tuple<bool, std::string, mrs_msgs::TrajectoryReference> MrsTrajectoryGenera
 
   auto position_cmd = mrs_lib::get_mutexed(mutex_position_cmd_, position_cmd_);
 
+  // | ------------------- planning deadline -------------------- |
+
+  // the deadline runs from the arrival of the request, the planning returns
+  // the best trajectory found until then
+  const double                                max_planning_time = mrs_lib::get_mutexed(mutex_params_, params_).max_planning_time;
+  const bool                                  deadline_enabled  = max_planning_time > 0;
+  const std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(max_planning_time));
+
+  auto remaining_time = [&]() { return std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count(); };
+
+  // a max_time, which is not positive, disables the limit of the optimization, the deadline keeps a minimal one even once it passed
+  auto optimization_max_time = [&]() { return deadline_enabled ? std::max(remaining_time(), 1e-3) : 0.0; };
+
   // reset the marker visualizers
   bw_original_.clearBuffers();
   bw_original_.clearVisuals();
@@ -539,6 +1037,22 @@ std::tuple<bool, std::string, mrs_msgs::TrajectoryReference> MrsTrajectoryGenera
 
   //}
 
+  const size_t n_waypoints_original = waypoints.size();
+  double       simplification_time  = 0.0;
+
+  if (_path_simplification_enabled_) {
+
+    const std::chrono::steady_clock::time_point simplification_start = std::chrono::steady_clock::now();
+
+    // the tolerance is relative to the allowed deviation of the trajectory from the (simplified) path
+    waypoints = simplifyPath(waypoints, _path_simplification_tolerance_ * _trajectory_max_segment_deviation_,
+                             use_heading_ ? _path_simplification_max_heading_error_ : 0.0);
+
+    simplification_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - simplification_start).count();
+  }
+
+  const size_t n_waypoints_simplified = waypoints.size();
+
   if (waypoints.size() <= 1) {
     std::stringstream ss;
     ss << "the path is empty (after postprocessing)";
@@ -546,17 +1060,26 @@ std::tuple<bool, std::string, mrs_msgs::TrajectoryReference> MrsTrajectoryGenera
     return std::tuple(false, ss.str(), mrs_msgs::TrajectoryReference());
   }
 
-  bool              safe = false;
-  int               traj_idx;
-  std::vector<bool> segment_safeness;
-  double            max_deviation;
+  bool                            safe = false;
+  int                             traj_idx;
+  std::vector<SegmentDeviation_t> segment_deviations;
+  double                          max_deviation;
 
   eth_mav_msgs::EigenTrajectoryPoint::Vector trajectory;
+  std::vector<double>                        segment_times;
+  bool                                       converged        = false;
+  bool                                       deadline_reached = false;
+  Replanning_t                               replanning;
+
+  // plannings after the first one, due to the subsectioning
+  int n_replans = 0;
 
-  auto result = findTrajectory(waypoints, position_cmd);
+  const std::chrono::steady_clock::time_point planning_start = std::chrono::steady_clock::now();
+
+  auto result = findTrajectory(waypoints, position_cmd, optimization_max_time(), _replanning_enabled_ ? &replanning : nullptr);
 
   if (result) {
-    trajectory = result.value();
+    std::tie(trajectory, segment_times, converged) = result.value();
   } else {
     std::stringstream ss;
     ss << "failed to find trajectory";
@@ -568,32 +1091,35 @@ std::tuple<bool, std::string, mrs_msgs::TrajectoryReference> MrsTrajectoryGenera
 
     ROS_DEBUG("[MrsTrajectoryGeneration]: revalidation cycle #%d", k);
 
-    std::tie(safe, traj_idx, segment_safeness, max_deviation) = validateTrajectory(trajectory, waypoints);
+    std::tie(safe, traj_idx, segment_deviations, max_deviation) = validateTrajectory(trajectory, segment_times, waypoints);
 
     if (_trajectory_max_segment_deviation_enabled_ && !safe) {
 
       ROS_DEBUG("[MrsTrajectoryGeneration]: not safe, max deviation %.2f m", max_deviation);
 
-      std::vector<Waypoint_t>::iterator waypoint = waypoints.begin();
-      std::vector<bool>::iterator       safeness = segment_safeness.begin();
+      if (deadline_enabled && remaining_time() <= 0) {
+        ROS_WARN("[MrsTrajectoryGeneration]: planning deadline reached, keeping the trajectory with max deviation %.2f m", max_deviation);
+        deadline_reached = true;
+        break;
+      }
 
-      for (; waypoint < waypoints.end() - 1; waypoint++) {
+      for (size_t i = 0; i < segment_deviations.size(); i++) {
+        if (!segment_deviations[i].safe) {
+          ROS_DEBUG("[MrsTrajectoryGeneration]: segment %lu (samples %lu-%lu) deviates by %.2f m", i, segment_deviations[i].samples_begin,
+                    segment_deviations[i].samples_end, segment_deviations[i].max_deviation);
+        }
+      }
 
-        if (!(*safeness)) {
+      const int n_new_waypoints = subsectionPath(waypoints, segment_deviations);
 
-          if (waypoint > waypoints.begin() || _max_deviation_first_segment_) {
-            Waypoint_t midpoint2 = interpolatePoint(*waypoint, *(waypoint + 1), 0.5);
-            waypoint             = waypoints.insert(waypoint + 1, midpoint2);
-          }
-        }
+      ROS_DEBUG("[MrsTrajectoryGeneration]: subsectioned by %d new waypoints", n_new_waypoints);
 
-        safeness++;
-      }
+      n_replans++;
 
-      auto result = findTrajectory(waypoints, position_cmd);
+      auto result = findTrajectory(waypoints, position_cmd, optimization_max_time(), _replanning_enabled_ ? &replanning : nullptr);
 
       if (result) {
-        trajectory = result.value();
+        std::tie(trajectory, segment_times, converged) = result.value();
       } else {
         std::stringstream ss;
         ss << "failed to find trajectory";
@@ -608,9 +1134,47 @@ std::tuple<bool, std::string, mrs_msgs::TrajectoryReference> MrsTrajectoryGenera
     }
   }
 
-  std::tie(safe, traj_idx, segment_safeness, max_deviation) = validateTrajectory(trajectory, waypoints);
+  std::tie(safe, traj_idx, segment_deviations, max_deviation) = validateTrajectory(trajectory, segment_times, waypoints);
+
+  const double planning_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - planning_start).count();
+
+  if (_path_simplification_enabled_) {
+    ROS_INFO("[MrsTrajectoryGeneration]: the path was simplified from %lu to %lu waypoints (%.1f %% of the segments) in %.1f ms, planning took %.1f ms",
+             n_waypoints_original, n_waypoints_simplified, 100.0 * (n_waypoints_simplified - 1) / (n_waypoints_original - 1), 1000.0 * simplification_time,
+             1000.0 * planning_time);
+  }
+
+  // | ----------------------- diagnostics ---------------------- |
+
+  int    n_plannings_with_deadline, n_deadline_misses;
+  double mean_replans;
+
+  {
+    std::scoped_lock lock(mutex_diagnostics_);
+
+    if (deadline_enabled) {
 
-  ROS_INFO("[MrsTrajectoryGeneration]: final max deviation %.2f m, total time: %.2f", max_deviation, trajectory.size() * _sampling_dt_);
+      deadline_reached |= remaining_time() <= 0;
+
+      n_plannings_with_deadline_++;
+
+      if (deadline_reached) {
+        n_deadline_misses_++;
+      }
+    }
+
+    n_plannings_with_deadline = n_plannings_with_deadline_;
+    n_deadline_misses         = n_deadline_misses_;
+
+    n_requests_++;
+    n_replans_ += n_replans;
+
+    mean_replans = double(n_replans_) / n_requests_;
+  }
+
+  ROS_INFO("[MrsTrajectoryGeneration]: final max deviation %.2f m, total time: %.2f, converged: %s, deadline misses: %d/%d, re-plans: %d (mean %.2f)",
+           max_deviation, trajectory.size() * _sampling_dt_, converged ? "true" : "false", n_deadline_misses, n_plannings_with_deadline, n_replans,
+           mean_replans);
 
   for (int i = 0; i < int(waypoints.size()); i++) {
     bw_final_.addPoint(vec3_t(waypoints.at(i).coords[0], waypoints.at(i).coords[1], waypoints.at(i).coords[2]), 0.0, 1.0, 0.0, 1.0);
@@ -618,7 +1182,15 @@ std::tuple<bool, std::string, mrs_msgs::TrajectoryReference> MrsTrajectoryGenera
 
   mrs_msgs::TrajectoryReference mrs_trajectory;
 
-  mrs_trajectory = getTrajectoryReference(trajectory, _max_deviation_first_segment_ ? ros::Time::now() : position_cmd.header.stamp);
+  mrs_trajectory = getTrajectoryReference(trajectory, _max_deviation_first_segment_ ? ros::Time::now() : position_cmd.header.stamp, frame_id_, fly_now_,
+                                          use_heading_);
+
+  // the re-planned trajectories keep the properties of this request
+  replanning.frame_id    = frame_id_;
+  replanning.fly_now     = fly_now_;
+  replanning.use_heading = use_heading_;
+
+  mrs_lib::set_mutexed(mutex_replanning_, replanning, replanning_next_);
 
   bw_original_.publish();
   bw_final_.publish();
@@ -626,11 +1198,72 @@ std::tuple<bool, std::string, mrs_msgs::TrajectoryReference> MrsTrajectoryGenera
   std::stringstream ss;
   ss << "trajectory generated";
 
+  if (!converged) {
+    ss << ", not converged";
+  }
+
+  if (deadline_reached) {
+    ss << ", planning deadline reached";
+  }
+
   return std::tuple(true, ss.str(), mrs_trajectory);
 }
 
 //}
 
+/* startReplanning() //{ */
+
+void MrsTrajectoryGeneration::startReplanning(const ros::Time& start_time) {
+
+  if (!_replanning_enabled_) {
+    return;
+  }
+
+  std::scoped_lock lock(mutex_replanning_);
+
+  // a trajectory, which is not flown right away, does not advance with the time
+  const bool has_optimizer = std::visit([](const auto& optimizer) { return bool(optimizer); }, replanning_next_.optimizer);
+
+  if (!replanning_next_.fly_now || !has_optimizer) {
+    replanning_ = Replanning_t();
+    return;
+  }
+
+  replanning_            = replanning_next_;
+  replanning_.start_time = start_time;
+  std::visit([&](const auto& optimizer) { optimizer->setMaxTime(_replanning_cycle_budget_); }, replanning_.optimizer);
+
+  replanning_next_ = Replanning_t();
+
+  replanning_n_cycles_       = 0;
+  replanning_n_overruns_     = 0;
+  replanning_cycle_time_sum_ = 0;
+  replanning_cycle_time_max_ = 0;
+
+  ROS_INFO("[MrsTrajectoryGeneration]: re-planning the path at %.1f Hz", _replanning_rate_);
+}
+
+//}
+
+/* stopReplanning() //{ */
+
+void MrsTrajectoryGeneration::stopReplanning() {
+
+  if (!_replanning_enabled_) {
+    return;
+  }
+
+  std::scoped_lock lock(mutex_replanning_);
+
+  if (std::visit([](const auto& optimizer) { return bool(optimizer); }, replanning_.optimizer)) {
+    ROS_INFO("[MrsTrajectoryGeneration]: re-planning stopped by a new path, %d cycles", replanning_n_cycles_);
+  }
+
+  replanning_ = Replanning_t();
+}
+
+//}
+
 // | --------------------- minor routines --------------------- |
 
 /* //{ randd() */
@@ -648,6 +1281,63 @@ double MrsTrajectoryGeneration::randd(const double from, const double to) {
 
 //}
 
+/* subsectionPath() //{ */
+
+int MrsTrajectoryGeneration::subsectionPath(std::vector<Waypoint_t>& waypoints, const std::vector<SegmentDeviation_t>& segment_deviations) {
+
+  const int max_new_waypoints = 8;
+
+  std::vector<Waypoint_t> subsectioned;
+
+  for (size_t i = 0; i < segment_deviations.size(); i++) {
+
+    subsectioned.push_back(waypoints.at(i));
+
+    const SegmentDeviation_t& segment = segment_deviations.at(i);
+
+    if (segment.safe || (i == 0 && !_max_deviation_first_segment_)) {
+      continue;
+    }
+
+    // the deviation shrinks roughly with the square of the segment length
+    const double violation       = segment.max_deviation / _trajectory_max_segment_deviation_;
+    const int    n_new_waypoints = std::clamp(int(std::ceil(std::sqrt(violation))), 1, max_new_waypoints);
+
+    // the first one at the maximum deviation, the others spread over both parts proportionally to their lengths
+    const double margin = 0.5 / (n_new_waypoints + 1);
+    const double split  = std::clamp(segment.max_deviation_coeff, margin, 1.0 - margin);
+    const int    n_left = int(std::round((n_new_waypoints - 1) * split));
+
+    std::vector<double> coeffs;
+
+    for (int j = 1; j <= n_left; j++) {
+      coeffs.push_back(split * j / (n_left + 1));
+    }
+
+    coeffs.push_back(split);
+
+    const int n_right = n_new_waypoints - 1 - n_left;
+
+    for (int j = 1; j <= n_right; j++) {
+      coeffs.push_back(split + (1.0 - split) * j / (n_right + 1));
+    }
+
+    for (const double coeff : coeffs) {
+      subsectioned.push_back(interpolatePoint(waypoints.at(i), waypoints.at(i + 1), coeff));
+    }
+  }
+
+  subsectioned.push_back(waypoints.back());
+
+  const int n_new_waypoints = int(subsectioned.size() - waypoints.size());
+
+  waypoints = subsectioned;
+
+  return n_new_waypoints;
+}
+
+//}
+
 /* distFromSegment() //{ */
 
 double MrsTrajectoryGeneration::distFromSegment(const vec3_t& point, const vec3_t& seg1, const vec3_t& seg2) {
@@ -678,14 +1368,15 @@ double MrsTrajectoryGeneration::distFromSegment(const vec3_t& point, const vec3_
 /* getTrajectoryReference() //{ */
 
 mrs_msgs::TrajectoryReference MrsTrajectoryGeneration::getTrajectoryReference(const eth_mav_msgs::EigenTrajectoryPoint::Vector& trajectory,
-                                                                              const ros::Time&                                  stamp) {
+                                                                              const ros::Time& stamp, const std::string& frame_id, const bool fly_now,
+                                                                              const bool use_heading) {
 
   mrs_msgs::TrajectoryReference msg;
 
-  msg.header.frame_id = frame_id_;
+  msg.header.frame_id = frame_id;
   msg.header.stamp    = stamp;
-  msg.fly_now         = fly_now_;
-  msg.use_heading     = use_heading_;
+  msg.fly_now         = fly_now;
+  msg.use_heading     = use_heading;
   msg.dt              = _sampling_dt_;
 
   for (size_t it = 0; it < trajectory.size(); it++) {
@@ -724,6 +1415,93 @@ Waypoint_t MrsTrajectoryGeneration::interpolatePoint(const Waypoint_t& a, const
 
 //}
 
+/* simplifyPath() //{ */
+
+std::vector<Waypoint_t> MrsTrajectoryGeneration::simplifyPath(const std::vector<Waypoint_t>& waypoints, const double tolerance,
+                                                              const double max_heading_error) {
+
+  if (waypoints.size() <= 2) {
+    return waypoints;
+  }
+
+  std::vector<bool> keep(waypoints.size(), false);
+
+  keep.front() = true;
+  keep.back()  = true;
+
+  for (size_t i = 1; i < waypoints.size() - 1; i++) {
+    if (waypoints.at(i).stop_at) {
+      keep.at(i) = true;
+    }
+  }
+
+  // the parts between the kept waypoints, each is split at its worst waypoint until all its waypoints are within the tolerance
+  std::vector<std::pair<size_t, size_t>> parts;
+
+  for (size_t i = 1, first = 0; i < waypoints.size(); i++) {
+    if (keep.at(i)) {
+      parts.push_back({first, i});
+      first = i;
+    }
+  }
+
+  while (!parts.empty()) {
+
+    const auto [first, last] = parts.back();
+    parts.pop_back();
+
+    const Eigen::Vector4d& start = waypoints.at(first).coords;
+    const Eigen::Vector4d& end   = waypoints.at(last).coords;
+
+    const vec3_t segment_start  = start.head<3>();
+    const vec3_t segment_end    = end.head<3>();
+    const vec3_t segment_vector = segment_end - segment_start;
+    const double segment_len_sq = segment_vector.squaredNorm();
+
+    // the errors relative to the tolerances, the waypoint is removed if both are below 1
+    double worst_error = 1.0;
+    size_t worst_idx   = 0;
+
+    for (size_t i = first + 1; i < last; i++) {
+
+      const vec3_t point = waypoints.at(i).coords.head<3>();
+
+      double error = distFromSegment(point, segment_start, segment_end) / tolerance;
+
+      if (max_heading_error > 0) {
+
+        const double coeff   = segment_len_sq > 0 ? std::clamp(segment_vector.dot(point - segment_start) / segment_len_sq, 0.0, 1.0) : 0.5;
+        const double heading = radians::interp(start[3], end[3], coeff);
+
+        error = std::max(error, radians::dist(waypoints.at(i).coords[3], heading) / max_heading_error);
+      }
+
+      if (error > worst_error) {
+        worst_error = error;
+        worst_idx   = i;
+      }
+    }
+
+    if (worst_idx > 0) {
+      keep.at(worst_idx) = true;
+      parts.push_back({first, worst_idx});
+      parts.push_back({worst_idx, last});
+    }
+  }
+
+  std::vector<Waypoint_t> simplified;
+
+  for (size_t i = 0; i < waypoints.size(); i++) {
+    if (keep.at(i)) {
+      simplified.push_back(waypoints.at(i));
+    }
+  }
+
+  return simplified;
+}
+
+//}
+
 /* trajectorySrv() //{ */
 
 bool MrsTrajectoryGeneration::trajectorySrv(const mrs_msgs::TrajectoryReference& msg) {
@@ -753,6 +1531,160 @@ bool MrsTrajectoryGeneration::trajectorySrv(const mrs_msgs::TrajectoryReference&
 
 //}
 
+// | ------------------------- timers ------------------------- |
+
+/* timerReplanning() //{ */
+
+void MrsTrajectoryGeneration::timerReplanning([[maybe_unused]] const ros::TimerEvent& event) {
+
+  if (!is_initialized_) {
+    return;
+  }
+
+  std::scoped_lock lock(mutex_replanning_);
+
+  if (!std::visit([](const auto& optimizer) { return bool(optimizer); }, replanning_.optimizer)) {
+    return;
+  }
+
+  auto position_cmd = mrs_lib::get_mutexed(mutex_position_cmd_, position_cmd_);
+
+  const std::chrono::steady_clock::time_point t_start = std::chrono::steady_clock::now();
+  const ros::Time                             now     = ros::Time::now();
+
+  const double heading = sradians::unwrap(position_cmd.heading, replanning_.start_heading);
+
+  // empty if the path is finished or could not be re-planned
+  std::optional<eth_mav_msgs::EigenTrajectoryPoint::Vector> states;
+
+  bool overrun = false;
+
+  std::visit(
+      [&](const auto& optimizer) {
+        auto&         opt = *optimizer;
+        constexpr int N   = std::decay_t<decltype(opt)>::N;
+
+        // | -------------- find the segment being flown -------------- |
+
+        std::vector<double> segment_times;
+        opt.getPolynomialOptimizationRef().getSegmentTimes(&segment_times);
+
+        const double elapsed          = (now - replanning_.start_time).toSec();
+        const double min_segment_time = 1.0 / _replanning_rate_;
+
+        // a segment ending before the next cycle is consumed as well, unless it is the last one
+        size_t n_consumed  = 0;
+        double segment_end = segment_times.front();
+
+        while (n_consumed + 1 < segment_times.size() && segment_end - elapsed < min_segment_time) {
+          n_consumed++;
+          segment_end += segment_times[n_consumed];
+        }
+
+        if (segment_end - elapsed < min_segment_time) {
+
+          ROS_INFO("[MrsTrajectoryGeneration]: re-planning finished, %d cycles, cycle time: mean %.1f ms, max %.1f ms, budget reached: %d",
+                   replanning_n_cycles_, replanning_n_cycles_ > 0 ? 1000.0 * replanning_cycle_time_sum_ / replanning_n_cycles_ : 0.0,
+                   1000.0 * replanning_cycle_time_max_, replanning_n_overruns_);
+          return;
+        }
+
+        // | ------ update the start and re-solve the remaining path ------ |
+
+        const int derivative_to_optimize = opt.getPolynomialOptimizationRef().getDerivativeToOptimize();
+
+        const eth_trajectory_generation::Vertex start = createStartVertex(
+            Eigen::Vector4d(position_cmd.position.x, position_cmd.position.y, position_cmd.position.z, heading), position_cmd, derivative_to_optimize);
+
+        eth_trajectory_generation::Vertex start_position(3), start_heading(1);
+
+        if (_heading_separately_) {
+
+          const int max_derivative = eth_trajectory_generation::PolynomialOptimization<N>::kHighestDerivativeToOptimize;
+
+          start.getSubdimension({0, 1, 2}, max_derivative, &start_position);
+          start.getSubdimension({3}, max_derivative, &start_heading);
+
+        } else {
+          start_position = start;
+        }
+
+        if (!opt.updateStartVertex(start_position, n_consumed, segment_end - elapsed)) {
+          ROS_ERROR("[MrsTrajectoryGeneration]: could not update the start of the re-planned path, re-planning stopped");
+          return;
+        }
+
+        opt.optimize();
+
+        overrun = opt.getOptimizationInfo().stopping_reason == nlopt::MAXTIME_REACHED;
+
+        eth_trajectory_generation::Trajectory trajectory_position, trajectory;
+
+        opt.getTrajectory(&trajectory_position);
+
+        if (_heading_separately_) {
+
+          replanning_.vertices_heading.erase(replanning_.vertices_heading.begin(), replanning_.vertices_heading.begin() + n_consumed);
+          replanning_.vertices_heading.front() = start_heading;
+
+          eth_trajectory_generation::Trajectory                trajectory_heading;
+          eth_trajectory_generation::PolynomialOptimization<N> opt_heading(1);
+          opt_heading.setupFromVertices(replanning_.vertices_heading, trajectory_position.getSegmentTimes(), derivative_to_optimize);
+          opt_heading.solveLinear();
+          opt_heading.getTrajectory(&trajectory_heading);
+
+          if (!trajectory_position.getTrajectoryWithAppendedDimension(trajectory_heading, &trajectory)) {
+            ROS_ERROR("[MrsTrajectoryGeneration]: could not append the heading to the re-planned trajectory, re-planning stopped");
+            return;
+          }
+
+        } else {
+          trajectory = trajectory_position;
+        }
+
+        eth_mav_msgs::EigenTrajectoryPoint::Vector sampled;
+
+        if (!eth_trajectory_generation::sampleWholeTrajectory(trajectory, _sampling_dt_, &sampled)) {
+          ROS_ERROR("[MrsTrajectoryGeneration]: could not sample the re-planned trajectory, re-planning stopped");
+          return;
+        }
+
+        states = sampled;
+      },
+      replanning_.optimizer);
+
+  if (!states) {
+    replanning_ = Replanning_t();
+    return;
+  }
+
+  replanning_.start_time    = now;
+  replanning_.start_heading = heading;
+
+  // | ------------------- cycle time statistics ------------------- |
+
+  const double cycle_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+  replanning_n_cycles_++;
+  replanning_cycle_time_sum_ += cycle_time;
+  replanning_cycle_time_max_ = std::max(replanning_cycle_time_max_, cycle_time);
+
+  if (overrun) {
+    replanning_n_overruns_++;
+  }
+
+  ROS_INFO_THROTTLE(5.0, "[MrsTrajectoryGeneration]: re-planning %d cycles, cycle time: last %.1f ms, mean %.1f ms, max %.1f ms, budget reached: %d",
+                    replanning_n_cycles_, 1000.0 * cycle_time, 1000.0 * replanning_cycle_time_sum_ / replanning_n_cycles_, 1000.0 * replanning_cycle_time_max_,
+                    replanning_n_overruns_);
+
+  if (!trajectorySrv(getTrajectoryReference(*states, now, replanning_.frame_id, replanning_.fly_now, replanning_.use_heading))) {
+    ROS_WARN("[MrsTrajectoryGeneration]: could not publish the re-planned trajectory, re-planning stopped");
+    replanning_ = Replanning_t();
+  }
+}
+
+//}
+
 // | ------------------------ callbacks ----------------------- |
 
 /* callbackTest() //{ */
@@ -799,12 +1731,18 @@ bool MrsTrajectoryGeneration::callbackTest([[maybe_unused]] std_srvs::Trigger::R
     waypoints.push_back(waypoint);
   }
 
+  stopReplanning();
+
   auto [success, message, trajectory] = optimize(waypoints);
 
   if (success) {
 
     bool published = trajectorySrv(trajectory);
 
+    if (published) {
+      startReplanning(trajectory.header.stamp);
+    }
+
     if (published) {
 
       res.success = success;
@@ -832,7 +1770,7 @@ bool MrsTrajectoryGeneration::callbackTest([[maybe_unused]] std_srvs::Trigger::R
 
 /* callbackPath() //{ */
 
-void MrsTrajectoryGeneration::callbackPath(const mrs_msgs::PathConstPtr& msg) {
+void MrsTrajectoryGeneration::callbackPath(const mrs_msgs::PathConstPtr& msg, const bool time_scaling_only) {
 
   if (!is_initialized_) {
     return;
@@ -874,21 +1812,36 @@ void MrsTrajectoryGeneration::callbackPath(const mrs_msgs::PathConstPtr& msg) {
     waypoints.push_back(wp);
   }
 
+  // the re-planned path of the previous request must not outlive it
+  stopReplanning();
+
   fly_now_                   = msg->fly_now;
   use_heading_               = msg->use_heading;
   frame_id_                  = msg->header.frame_id;
   override_constraints_      = msg->override_constraints;
   override_max_velocity_     = msg->override_max_velocity;
   override_max_acceleration_ = msg->override_max_acceleration;
+  time_scaling_only_         = time_scaling_only;
 
   auto [success, message, trajectory] = optimize(waypoints);
+
+  if (success) {
+
+    bool published = trajectorySrv(trajectory);
+
+    if (published) {
+      startReplanning(trajectory.header.stamp);
+    } else {
+      ROS_ERROR("[MrsTrajectoryGeneration]: could not publish the trajectory");
+    }
+  }
 }
 
 //}
 
 /* callbackPathSrv() //{ */
 
-bool MrsTrajectoryGeneration::callbackPathSrv(mrs_msgs::PathSrv::Request& req, mrs_msgs::PathSrv::Response& res) {
+bool MrsTrajectoryGeneration::callbackPathSrv(mrs_msgs::PathSrv::Request& req, mrs_msgs::PathSrv::Response& res, const bool time_scaling_only) {
 
   if (!is_initialized_) {
     return false;
@@ -936,12 +1889,16 @@ bool MrsTrajectoryGeneration::callbackPathSrv(mrs_msgs::PathSrv::Request& req, m
     waypoints.push_back(wp);
   }
 
+  // the re-planned path of the previous request must not outlive it
+  stopReplanning();
+
   fly_now_                   = req.path.fly_now;
   use_heading_               = req.path.use_heading;
   frame_id_                  = req.path.header.frame_id;
   override_constraints_      = req.path.override_constraints;
   override_max_velocity_     = req.path.override_max_velocity;
   override_max_acceleration_ = req.path.override_max_acceleration;
+  time_scaling_only_         = time_scaling_only;
 
   auto [success, message, trajectory] = optimize(waypoints);
 
@@ -949,6 +1906,10 @@ bool MrsTrajectoryGeneration::callbackPathSrv(mrs_msgs::PathSrv::Request& req, m
 
     bool published = trajectorySrv(trajectory);
 
+    if (published) {
+      startReplanning(trajectory.header.stamp);
+    }
+
     if (published) {
 
       res.success = success;